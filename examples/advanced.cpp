@@ -239,10 +239,25 @@ void loop()
 
         auto data = rxMic();
         preProcess(data);
-        cmdvox::DetectResult result;
-        if (commander_.detect(data, &result))
+        /*
+            Tips (4)
+            The candidates of one voice section are available from a single scoring pass.
+            If the margin of the best candidate is small, the match may be ambiguous.
+        */
+        cmdvox::DetectResult candidates[3];
+        const int count = commander_.detectNBest(data, candidates, 3);
+        if (count > 0)
         {
-            results.push_back(result);
+            std::string candStr;
+            for (int i = 0; i < count; i++)
+            {
+                candStr += candidates[i].command_name
+                + "(" + std::to_string(candidates[i].score) + "/" + std::to_string(candidates[i].margin) + "), ";
+            }
+            M5.Display.drawString("                                            ", 0, 50);
+            M5.Display.drawString(candStr.c_str(), 0, 50);
+
+            results.push_back(candidates[0]);
             compLife = 100;
             std::string compStr;
             for (const auto& result: results)
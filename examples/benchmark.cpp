@@ -0,0 +1,297 @@
+#include <M5Unified.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <SD.h>
+
+#include "cmdvox.h"
+#include "decimator.h"
+#include "fixed_commander.h"
+
+constexpr char TAG[] = "Main";
+constexpr int kSampleRate = 16000;
+constexpr int kSampleNum = 3;
+constexpr int kCoefNum = 12;
+constexpr int kLimitTimeMs = 3000;
+using FixedCommander = cmdvox::FixedMfccCommander<cmdvox::FixedConfig<kSampleRate, kCoefNum, kLimitTimeMs>>;
+
+/*
+    This is an example of measuring the scoring time of each mode.
+    Commands registered by "reg_and_save" are loaded from the sd card,
+    and every detected voice section is scored by all commanders.
+*/
+cmdvox::MfccCommander exact_;
+cmdvox::MfccCommander coarse_;
+cmdvox::MfccCommander int8_;
+cmdvox::MfccCommander incremental_;
+cmdvox::MfccCommander spotter_;
+cmdvox::MfccCommander dynamic_;
+FixedCommander fixed_;
+cmdvox::MfccCommander gated_;
+cmdvox::MfccCommander vad8k_;
+cmdvox::Decimator wide_mfcc_decimator_;
+cmdvox::Decimator wide_vad_decimator_;
+cmdvox::MfccCommander prefilter_;
+cmdvox::MfccCommander embedding_;
+int64_t exact_cpu_us_ = 0;
+int64_t gated_cpu_us_ = 0;
+int64_t listen_frame_count_ = 0;
+int exact_segment_count_ = 0;
+int gated_segment_count_ = 0;
+int64_t dynamic_frame_us_ = 0;
+int64_t fixed_frame_us_ = 0;
+int64_t vad16k_us_ = 0;
+int64_t vad8k_us_ = 0;
+int64_t wide_decimate_us_ = 0;
+int decimate_frame_count_ = 0;
+int16_t* wide_frame_;
+int16_t* decimated_frame_;
+int frame_count_ = 0;
+int64_t spot_us_ = 0;
+int64_t spot_max_us_ = 0;
+int spot_count_ = 0;
+int utterance_count_ = 0;
+int coarse_agree_count_ = 0;
+int64_t exact_us_sum_ = 0;
+int64_t coarse_us_sum_ = 0;
+int int8_agree_count_ = 0;
+int64_t int8_drift_sum_ = 0;
+int prefilter_agree_count_ = 0;
+int embedding_agree_count_ = 0;
+std::string rootPath_ = "/sd";
+int16_t* raw_buffer_;
+int sample_length_;
+
+void abort()
+{
+    ESP_LOGE(TAG, "aborted");
+    while(true) { vTaskDelay(500 / portTICK_PERIOD_MS); }
+}
+
+bool initMicBuffer(int length)
+{
+    sample_length_ = length;
+    raw_buffer_ = (int16_t*)heap_caps_malloc(kSampleNum * sizeof(*raw_buffer_) * sample_length_, MALLOC_CAP_8BIT);
+    return (raw_buffer_ != nullptr);
+}
+
+int16_t* rxMic()
+{
+    static int sample_index = 0;
+    M5.Mic.record(&raw_buffer_[sample_length_ * sample_index++], sample_length_);
+    if (sample_index >= kSampleNum) { sample_index = 0; }
+    return &raw_buffer_[sample_length_ * sample_index];
+}
+
+int64_t measure(cmdvox::MfccCommander& commander, const simplevox::MfccFeature& feature, cmdvox::DetectResult* result)
+{
+    const auto start = esp_timer_get_time();
+    if (!commander.detect(feature, result))
+    {
+        result->command_name = "-";
+        result->score = UINT32_MAX;
+    }
+    return esp_timer_get_time() - start;
+}
+
+void setup()
+{
+    auto micConfig = M5.Mic.config();
+    cmdvox::CommanderConfig cmdConfig;
+    micConfig.sample_rate
+    = cmdConfig.vad_config.sample_rate
+    = cmdConfig.mfcc_config.sample_rate
+    = kSampleRate;
+
+    if (!exact_.init(cmdConfig)) { abort(); }
+    cmdConfig.coarse_factor = 4;
+    if (!coarse_.init(cmdConfig)) { abort(); }
+    cmdConfig.coarse_factor = 1;
+    cmdConfig.template_format = cmdvox::TemplateFormat::Int8;
+    if (!int8_.init(cmdConfig)) { abort(); }
+    cmdConfig.template_format = cmdvox::TemplateFormat::Int16;
+    cmdConfig.normalization = cmdvox::FeatureNormalization::Incremental;
+    if (!incremental_.init(cmdConfig)) { abort(); }
+    cmdConfig.normalization = cmdvox::FeatureNormalization::Engine;
+    cmdConfig.embedding_scoring = cmdvox::EmbeddingScoring::Prefilter;
+    if (!prefilter_.init(cmdConfig)) { abort(); }
+    cmdConfig.embedding_scoring = cmdvox::EmbeddingScoring::Standalone;
+    if (!embedding_.init(cmdConfig)) { abort(); }
+    cmdConfig.embedding_scoring = cmdvox::EmbeddingScoring::Off;
+    cmdConfig.spotting = true;
+    if (!spotter_.init(cmdConfig)) { abort(); }
+    cmdConfig.spotting = false;
+    cmdConfig = FixedCommander::Config::apply(cmdConfig);
+    if (!dynamic_.init(cmdConfig)) { abort(); }
+    if (!fixed_.init(cmdConfig)) { abort(); }
+    cmdConfig = cmdvox::CommanderConfig();
+    cmdConfig.vad_config.sample_rate
+    = cmdConfig.mfcc_config.sample_rate
+    = kSampleRate;
+    cmdConfig.gate_level = 200;
+    if (!gated_.init(cmdConfig)) { abort(); }
+    cmdConfig.gate_level = 0;
+    cmdConfig.capture_rate = kSampleRate;
+    cmdConfig.vad_config.sample_rate = kSampleRate / 2;
+    if (!vad8k_.init(cmdConfig)) { abort(); }
+    if (!initMicBuffer(exact_.feed_length())) { abort(); }
+    // A 48 kHz frame is decimated by 3 for MFCC at 16 kHz and by 6 for VAD at 8 kHz.
+    const int wide_length = 3 * sample_length_;
+    wide_frame_ = (int16_t*)heap_caps_malloc(sizeof(*wide_frame_) * wide_length, MALLOC_CAP_8BIT);
+    decimated_frame_ = (int16_t*)heap_caps_malloc(sizeof(*decimated_frame_) * sample_length_, MALLOC_CAP_8BIT);
+    if (wide_frame_ == nullptr || decimated_frame_ == nullptr) { abort(); }
+    if (!wide_mfcc_decimator_.init(3, wide_length) || !wide_vad_decimator_.init(6, wide_length)) { abort(); }
+
+    M5.Mic.config(micConfig);
+    M5.begin();
+    M5.Mic.begin();
+
+    if (!SD.begin(GPIO_NUM_4, SPI, 25000000, rootPath_.c_str())) { abort(); }
+    exact_.loadSettings(rootPath_ + "/cmd_settings.json");
+    coarse_.loadSettings(rootPath_ + "/cmd_settings.json");
+    int8_.loadSettings(rootPath_ + "/cmd_settings.json");
+    prefilter_.loadSettings(rootPath_ + "/cmd_settings.json");
+    embedding_.loadSettings(rootPath_ + "/cmd_settings.json");
+    spotter_.loadSettings(rootPath_ + "/cmd_settings.json");
+    dynamic_.loadSettings(rootPath_ + "/cmd_settings.json");
+    fixed_.loadSettings(rootPath_ + "/cmd_settings.json");
+}
+
+void loop()
+{
+    auto data = rxMic();
+
+    // Continuous spotting must finish within a frame period to run in real time, including the slowest hop.
+    // The time does not depend on the templates, which reg_and_save creates with Engine normalization.
+    cmdvox::SpotResult spot_result;
+    const auto start = esp_timer_get_time();
+    const bool is_spotted = spotter_.spot(data, &spot_result);
+    const auto spot_us = esp_timer_get_time() - start;
+    spot_us_ += spot_us;
+    spot_max_us_ = std::max(spot_max_us_, spot_us);
+    if (++spot_count_ == 1000)
+    {
+        const int frame_us = 1000000LL * sample_length_ / kSampleRate;
+        ESP_LOGI(TAG, "spot  : %lld us/frame (max %lld us), %.1f %% of the frame period %d us", spot_us_ / spot_count_,
+            spot_max_us_, 100.0f * spot_us_ / spot_count_ / frame_us, frame_us);
+        spot_us_ = 0;
+        spot_max_us_ = 0;
+        spot_count_ = 0;
+    }
+    if (is_spotted)
+    {
+        ESP_LOGI(TAG, "spot  : %s(%lu) [%d, %d]", spot_result.command_name.c_str(), spot_result.score,
+            spot_result.start_frame, spot_result.end_frame);
+    }
+
+    // Per-frame cost of the fixed commander against the dynamic one with the same config
+    const bool can_fetch = dynamic_.feedSample(data).can_fetch;
+    fixed_.feedSample(data);
+    dynamic_frame_us_ += dynamic_.frame_stats().vad_us + dynamic_.frame_stats().mfcc_us;
+    fixed_frame_us_ += fixed_.frame_stats().vad_us + fixed_.frame_stats().mfcc_us;
+    if (++frame_count_ == 1000)
+    {
+        ESP_LOGI(TAG, "frame : dynamic %lld us, fixed %lld us", dynamic_frame_us_ / frame_count_, fixed_frame_us_ / frame_count_);
+        dynamic_frame_us_ = 0;
+        fixed_frame_us_ = 0;
+        frame_count_ = 0;
+    }
+    if (can_fetch)
+    {
+        auto feature = dynamic_.fetchFeature().feature;
+        fixed_.fetchFeature();
+        cmdvox::DetectResult dynamic_result, fixed_result;
+        const auto dynamic_us = measure(dynamic_, *feature, &dynamic_result);
+        const auto fixed_us = measure(fixed_, *feature, &fixed_result);
+        ESP_LOGI(TAG, "fixed : %s(%lu) %lld us, dynamic %lld us x%.2f", fixed_result.command_name.c_str(), fixed_result.score, fixed_us,
+            dynamic_us, static_cast<float>(dynamic_us) / fixed_us);
+    }
+
+    // End-of-speech latency of the incremental normalization
+    if (incremental_.feedSample(data).can_fetch)
+    {
+        incremental_.fetchFeature();
+        ESP_LOGI(TAG, "fetch : %lu us (incremental)", incremental_.frame_stats().fetch_us);
+    }
+
+    // CPU time of the listening pipeline with and without the energy gate.
+    // A segment found only without the gate counts as a missed onset.
+    const bool is_exact_fetchable = exact_.feedSample(data).can_fetch;
+    exact_cpu_us_ += exact_.frame_stats().vad_us + exact_.frame_stats().mfcc_us;
+    if (gated_.feedSample(data).can_fetch)
+    {
+        gated_.fetchFeature();
+        gated_segment_count_++;
+    }
+    gated_cpu_us_ += gated_.frame_stats().vad_us + gated_.frame_stats().mfcc_us;
+
+    // Decimation cost against the VAD time it saves (Decimator::kTapsPerPhase multiply-adds per input sample).
+    // VAD at 8 kHz from the 16 kHz capture includes its x2 decimation in vad_us.
+    if (vad8k_.feedSample(data).can_fetch) { vad8k_.fetchFeature(); }
+    if (exact_.frame_stats().vad_us > 0 && vad8k_.frame_stats().vad_us > 0)
+    {
+        vad16k_us_ += exact_.frame_stats().vad_us;
+        vad8k_us_ += vad8k_.frame_stats().vad_us;
+        // The same frame as a 48 kHz capture, decimated for both stages
+        for (int i = 0; i < 3 * sample_length_; i++) { wide_frame_[i] = data[i / 3]; }
+        const auto decimate_start = esp_timer_get_time();
+        wide_mfcc_decimator_.process(wide_frame_, 3 * sample_length_, decimated_frame_);
+        wide_vad_decimator_.process(wide_frame_, 3 * sample_length_, decimated_frame_);
+        wide_decimate_us_ += esp_timer_get_time() - decimate_start;
+        if (++decimate_frame_count_ == 1000)
+        {
+            ESP_LOGI(TAG, "decim : vad 16k %lld us, vad 8k %lld us (with x2), 48k x3 + x6 %lld us per frame",
+                vad16k_us_ / decimate_frame_count_, vad8k_us_ / decimate_frame_count_, wide_decimate_us_ / decimate_frame_count_);
+            vad16k_us_ = 0;
+            vad8k_us_ = 0;
+            wide_decimate_us_ = 0;
+            decimate_frame_count_ = 0;
+        }
+    }
+
+    if (++listen_frame_count_ % 6000 == 0)
+    {
+        const float hours = static_cast<float>(listen_frame_count_) * sample_length_ / kSampleRate / 3600;
+        ESP_LOGI(TAG, "gate  : %.1f s/h (no gate %.1f s/h), segments %d/%d",
+            gated_cpu_us_ / 1e6f / hours, exact_cpu_us_ / 1e6f / hours, gated_segment_count_, exact_segment_count_);
+    }
+
+    if (is_exact_fetchable)
+    {
+        exact_segment_count_++;
+        auto feature = exact_.fetchFeature().feature;
+        ESP_LOGI(TAG, "fetch : %lu us", exact_.frame_stats().fetch_us);
+        cmdvox::DetectResult exact_result, coarse_result, int8_result;
+        const auto exact_us = measure(exact_, *feature, &exact_result);
+        const auto coarse_us = measure(coarse_, *feature, &coarse_result);
+        const auto int8_us = measure(int8_, *feature, &int8_result);
+
+        // Speedup and detection agreement of coarse-to-fine scoring against exact scoring
+        utterance_count_++;
+        if (exact_result.command_name == coarse_result.command_name) { coarse_agree_count_++; }
+        exact_us_sum_ += exact_us;
+        coarse_us_sum_ += coarse_us;
+        ESP_LOGI(TAG, "exact : %s(%lu) %lld us", exact_result.command_name.c_str(), exact_result.score, exact_us);
+        ESP_LOGI(TAG, "coarse: %s(%lu) %lld us x%.2f, agree %d/%d, mean x%.2f", coarse_result.command_name.c_str(), coarse_result.score, coarse_us,
+            static_cast<float>(exact_us) / coarse_us, coarse_agree_count_, utterance_count_, static_cast<float>(exact_us_sum_) / coarse_us_sum_);
+
+        // Score drift and detection agreement of the int8 bank against the int16 bank
+        if (exact_result.command_name == int8_result.command_name) { int8_agree_count_++; }
+        if (exact_result.score != UINT32_MAX && int8_result.score != UINT32_MAX)
+        {
+            int8_drift_sum_ += std::abs(static_cast<int64_t>(int8_result.score) - exact_result.score);
+        }
+        ESP_LOGI(TAG, "int8  : %s(%lu) %lld us, agree %d/%d, mean drift %.2f", int8_result.command_name.c_str(), int8_result.score, int8_us,
+            int8_agree_count_, utterance_count_, static_cast<float>(int8_drift_sum_) / utterance_count_);
+
+        // Recall of the embedding index as a pre-filter and as a standalone scorer against pure DTW
+        cmdvox::DetectResult prefilter_result, embedding_result;
+        const auto prefilter_us = measure(prefilter_, *feature, &prefilter_result);
+        const auto embedding_us = measure(embedding_, *feature, &embedding_result);
+        if (exact_result.command_name == prefilter_result.command_name) { prefilter_agree_count_++; }
+        if (exact_result.command_name == embedding_result.command_name) { embedding_agree_count_++; }
+        ESP_LOGI(TAG, "embed : prefilter %s %lld us (agree %d/%d), standalone %s %lld us (agree %d/%d)",
+            prefilter_result.command_name.c_str(), prefilter_us, prefilter_agree_count_, utterance_count_,
+            embedding_result.command_name.c_str(), embedding_us, embedding_agree_count_, utterance_count_);
+    }
+}
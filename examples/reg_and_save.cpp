@@ -176,7 +176,9 @@ void loop()
                     .name = cmdName_,
                     .id = 0,
                     .threshold = 180,
-                    .path = cmdPath_
+                    .path = cmdPath_,
+                    .trim_begin = result.trim_begin,
+                    .trim_end = result.trim_end
                 },
                 .feature = std::move(result.feature)
             });
@@ -0,0 +1,576 @@
+#include <M5Unified.h>
+
+#include <esp_log.h>
+#include <SD.h>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "cmdvox.h"
+#include "decimator.h"
+#include "embedding.h"
+#include "feature_stats.h"
+#include "trace.h"
+
+constexpr char TAG[] = "Main";
+constexpr int kSampleRate = 16000;
+constexpr int kCoefNum = 12;
+
+/*
+    This is an example of checking the commander on the device.
+    Each check logs PASS or FAIL, and the number of failures is logged at the end.
+    Files named "self_test*" are created on the sd card.
+*/
+std::string rootPath_ = "/sd";
+int failure_count_ = 0;
+
+void abort()
+{
+    ESP_LOGE(TAG, "aborted");
+    while(true) { vTaskDelay(500 / portTICK_PERIOD_MS); }
+}
+
+void expect(bool condition, const char* name)
+{
+    if (condition)
+    {
+        ESP_LOGI(TAG, "PASS: %s", name);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "FAIL: %s", name);
+        failure_count_++;
+    }
+}
+
+cmdvox::CommanderConfig defaultConfig()
+{
+    cmdvox::CommanderConfig config;
+    config.vad_config.sample_rate
+    = config.mfcc_config.sample_rate
+    = kSampleRate;
+    return config;
+}
+
+simplevox::MfccFeature* syntheticFeature(int frame_num, int seed)
+{
+    auto feature = new simplevox::MfccFeature(frame_num, kCoefNum);
+    for (int i = 0; i < frame_num * kCoefNum; i++)
+    {
+        feature->feature[i] = (i * 37 + seed * 101) % 512 - 256;
+    }
+    return feature;
+}
+
+/**
+ * @brief A journal record longer than any read buffer is replayed with the records after it.
+ */
+void checkLongJournalRecord()
+{
+    const auto settings_path = rootPath_ + "/self_test_settings.json";
+    remove(settings_path.c_str());
+    remove((settings_path + ".journal").c_str());
+    remove((settings_path + ".journal.old").c_str());
+
+    cmdvox::MfccCommander writer;
+    if (!writer.init(defaultConfig())) { abort(); }
+    writer.saveSettings(settings_path);
+    if (!writer.openJournal(settings_path)) { abort(); }
+    const char* names[] = { "long", "short" };
+    for (int i = 0; i < 2; i++)
+    {
+        const auto path = rootPath_ + "/self_test_" + names[i] + ".bin";
+        std::unique_ptr<simplevox::MfccFeature> feature(syntheticFeature(40 + 10 * i, i));
+        cmdvox::MfccCommander::saveFeature(path.c_str(), *feature);
+        cmdvox::MfccCommand command {
+            .info = cmdvox::CommandInfo {
+                .name = names[i],
+                .id = 0,
+                .threshold = UINT32_MAX,
+                .path = path
+            },
+            .feature = std::move(feature)
+        };
+        // About 1 KB of contexts in the first record
+        for (int k = 0; i == 0 && k < 40; k++)
+        {
+            command.info.contexts.push_back("context_with_a_long_name_" + std::to_string(k));
+        }
+        writer.add(std::move(command));
+    }
+    writer.closeJournal();
+
+    cmdvox::MfccCommander reader;
+    if (!reader.init(defaultConfig())) { abort(); }
+    reader.loadSettings(settings_path);
+    std::unique_ptr<simplevox::MfccFeature> query(syntheticFeature(45, 0));
+    cmdvox::DetectResult results[2];
+    const int count = reader.detectNBest(*query, results, 2);
+    expect(count == 2, "long journal record and the record after it are replayed");
+}
+
+cmdvox::MfccCommand syntheticCommand(const std::string& name, int frame_num, int seed)
+{
+    const auto path = rootPath_ + "/self_test_" + name + ".bin";
+    std::unique_ptr<simplevox::MfccFeature> feature(syntheticFeature(frame_num, seed));
+    cmdvox::MfccCommander::saveFeature(path.c_str(), *feature);
+    return cmdvox::MfccCommand {
+        .info = cmdvox::CommandInfo {
+            .name = name,
+            .id = 0,
+            .threshold = UINT32_MAX,
+            .path = path
+        },
+        .feature = std::move(feature)
+    };
+}
+
+/**
+ * @brief Compaction is tried again after a failed snapshot, and no record is lost.
+ */
+void checkCompactionRetry()
+{
+    const auto settings_path = rootPath_ + "/self_test_compact.json";
+    const auto old_path = settings_path + ".journal.old";
+    const auto temp_path = settings_path + ".tmp";
+    remove(settings_path.c_str());
+    remove((settings_path + ".journal").c_str());
+    remove(old_path.c_str());
+    rmdir(temp_path.c_str());
+
+    cmdvox::MfccCommander writer;
+    if (!writer.init(defaultConfig())) { abort(); }
+    writer.saveSettings(settings_path);
+    // Every record exceeds the journal limit, so that each append starts compaction.
+    if (!writer.openJournal(settings_path, 100)) { abort(); }
+    // The snapshot cannot be written while a directory takes the name of the temporary file.
+    mkdir(temp_path.c_str(), 0777);
+    writer.add(syntheticCommand("first", 40, 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    rmdir(temp_path.c_str());
+    writer.add(syntheticCommand("second", 50, 2));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    writer.closeJournal();
+
+    struct stat info;
+    expect(stat(old_path.c_str(), &info) != 0, "compaction succeeds after a failed snapshot");
+
+    cmdvox::MfccCommander reader;
+    if (!reader.init(defaultConfig())) { abort(); }
+    reader.loadSettings(settings_path);
+    std::unique_ptr<simplevox::MfccFeature> query(syntheticFeature(45, 0));
+    cmdvox::DetectResult results[2];
+    expect(reader.detectNBest(*query, results, 2) == 2, "records of the failed compaction are kept");
+}
+
+/**
+ * @brief Records merged by saveSettings are not replayed again, and later ones are.
+ */
+void checkSaveWithJournal()
+{
+    const auto settings_path = rootPath_ + "/self_test_save.json";
+    remove(settings_path.c_str());
+    remove((settings_path + ".journal").c_str());
+    remove((settings_path + ".journal.old").c_str());
+
+    cmdvox::MfccCommander writer;
+    if (!writer.init(defaultConfig())) { abort(); }
+    writer.saveSettings(settings_path);
+    if (!writer.openJournal(settings_path)) { abort(); }
+    writer.add(syntheticCommand("merged", 40, 1));
+    writer.saveSettings(settings_path);
+    writer.add(syntheticCommand("appended", 50, 2));
+    writer.closeJournal();
+    // A command removed after the journal is closed must not come back from the journal.
+    writer.remove("merged");
+    writer.saveSettings(settings_path);
+
+    cmdvox::MfccCommander reader;
+    if (!reader.init(defaultConfig())) { abort(); }
+    reader.loadSettings(settings_path);
+    std::unique_ptr<simplevox::MfccFeature> query(syntheticFeature(45, 0));
+    cmdvox::DetectResult results[3];
+    const int count = reader.detectNBest(*query, results, 3);
+    expect(count == 1 && results[0].command_name == "appended", "saved settings are not overridden by merged journal records");
+}
+
+/**
+ * @brief Settings with many short contexts are read completely.
+ */
+void checkManyContexts()
+{
+    const auto settings_path = rootPath_ + "/self_test_contexts.json";
+    remove(settings_path.c_str());
+    remove((settings_path + ".journal").c_str());
+    remove((settings_path + ".journal.old").c_str());
+
+    cmdvox::MfccCommander writer;
+    if (!writer.init(defaultConfig())) { abort(); }
+    auto command = syntheticCommand("contexts", 40, 1);
+    // Each element takes more room in the document than its text
+    for (int k = 0; k < 200; k++)
+    {
+        command.info.contexts.push_back("c" + std::to_string(k));
+    }
+    writer.add(std::move(command));
+    writer.saveSettings(settings_path);
+
+    cmdvox::MfccCommander reader;
+    if (!reader.init(defaultConfig())) { abort(); }
+    reader.loadSettings(settings_path);
+    reader.activateContexts({ "c199" });
+    std::unique_ptr<simplevox::MfccFeature> query(syntheticFeature(45, 0));
+    cmdvox::DetectResult results[1];
+    expect(reader.detectNBest(*query, results, 1) == 1, "settings with many short contexts are read");
+}
+
+/**
+ * @brief Settings saved to another path than the journal are not stamped with its generation.
+ */
+void checkCopyGeneration()
+{
+    const auto settings_path = rootPath_ + "/self_test_original.json";
+    const auto copy_path = rootPath_ + "/self_test_copy.json";
+    remove(settings_path.c_str());
+    remove((settings_path + ".journal").c_str());
+    remove((settings_path + ".journal.old").c_str());
+
+    cmdvox::MfccCommander writer;
+    if (!writer.init(defaultConfig())) { abort(); }
+    writer.saveSettings(settings_path);
+    if (!writer.openJournal(settings_path)) { abort(); }
+    writer.add(syntheticCommand("copied", 40, 1));
+    writer.saveSettings(copy_path);
+    writer.closeJournal();
+
+    char header[32] = {};
+    FILE* file = fopen(copy_path.c_str(), "r");
+    if (file == NULL) { abort(); }
+    fread(header, 1, sizeof(header) - 1, file);
+    fclose(file);
+    expect(strncmp(header, "{\"generation\":0,", 16) == 0, "copied settings have no journal generation");
+}
+
+/**
+ * @brief A feature without frames embeds to zeros instead of reading frame 0.
+ */
+void checkEmptyEmbedding()
+{
+    const int16_t data[kCoefNum] = {};
+    const cmdvox::FeatureView empty { .data = data, .frame_num = 0, .coef_num = kCoefNum };
+    std::vector<float> embedding(cmdvox::EmbeddingIndex::lengthOf(kCoefNum), NAN);
+    cmdvox::EmbeddingIndex::embed(empty, embedding.data());
+    expect(std::all_of(embedding.begin(), embedding.end(), [](float value) { return value == 0.0f; }),
+        "an empty feature embeds to zeros");
+}
+
+/**
+ * @brief Feeds a tone (amplitude 0: low noise) and fetches any segment it completes.
+ * @return the largest frame count during the last 300 ms
+ */
+int feedTone(cmdvox::MfccCommander* commander, int length_ms, float amplitude, int* fetch_count)
+{
+    const int length = commander->feed_length();
+    std::vector<int16_t> samples(length);
+    const int feed_num = length_ms * kSampleRate / 1000 / length;
+    int frame_count = 0;
+    for (int n = 0; n < feed_num; n++)
+    {
+        for (int i = 0; i < length; i++)
+        {
+            const int index = n * length + i;
+            samples[i] = static_cast<int16_t>(amplitude * sinf(2.0f * 3.14159265f * 200.0f * index / kSampleRate)
+                + (index * 7919 % 61) - 30);
+        }
+        if (commander->feedSample(samples.data()).can_fetch)
+        {
+            commander->fetchFeature();
+            (*fetch_count)++;
+        }
+        if ((feed_num - n) * length <= 300 * kSampleRate / 1000)
+        {
+            frame_count = std::max(frame_count, commander->frame_stats().frame_count);
+        }
+    }
+    return frame_count;
+}
+
+/**
+ * @brief Lazy features go back to buffering samples only after a false start, and the next utterance is captured.
+ */
+void checkLazyFalseStart()
+{
+    auto config = defaultConfig();
+    config.lazy_feature = true;
+    cmdvox::MfccCommander commander;
+    if (!commander.init(config)) { abort(); }
+    int fetch_count = 0;
+    feedTone(&commander, 1000, 0.0f, &fetch_count);
+    // A burst too short to be a segment
+    feedTone(&commander, 150, 8000.0f, &fetch_count);
+    const int silence_frame_count = feedTone(&commander, 1000, 0.0f, &fetch_count);
+    expect(silence_frame_count == 0, "no frames are calculated in the silence after a false start");
+    fetch_count = 0;
+    feedTone(&commander, 600, 8000.0f, &fetch_count);
+    feedTone(&commander, 800, 0.0f, &fetch_count);
+    expect(fetch_count == 1, "the utterance after a false start is captured");
+}
+
+/**
+ * @brief Feeds a tone at the capture rate and collects the frame counts of the fetched segments.
+ * @param[out] frame_nums   nullptr to discard the segments
+ * @param[out] values       coefficients of the segments appended in order (nullptr: not collected)
+ */
+void feedSegments(cmdvox::MfccCommander* commander, int length_ms, float amplitude, std::vector<int>* frame_nums,
+    std::vector<int16_t>* values = nullptr)
+{
+    const int length = commander->feed_length();
+    const int rate = length * 1000 / commander->config().vad_config.frame_time_ms;
+    std::vector<int16_t> samples(length);
+    for (int n = 0; n < length_ms * rate / 1000 / length; n++)
+    {
+        for (int i = 0; i < length; i++)
+        {
+            const int index = n * length + i;
+            samples[i] = static_cast<int16_t>(amplitude * sinf(2.0f * 3.14159265f * 200.0f * index / rate)
+                + (index * 7919 % 61) - 30);
+        }
+        if (commander->feedSample(samples.data()).can_fetch)
+        {
+            const auto feature = commander->fetchFeature().feature;
+            const auto view = cmdvox::viewOf(*feature);
+            if (frame_nums != nullptr) { frame_nums->push_back(view.frame_num); }
+            if (values != nullptr) { values->insert(values->end(), view.data, view.data + view.frame_num * view.coef_num); }
+        }
+    }
+}
+
+/**
+ * @brief A lazy commander fetches the same segment as an eager one when speech follows a false start within the pre-roll.
+ */
+void checkLazyPreRoll(cmdvox::FeatureNormalization normalization)
+{
+    std::vector<int> frame_nums[2];
+    std::vector<int16_t> values[2];
+    for (int i = 0; i < 2; i++)
+    {
+        auto config = defaultConfig();
+        config.lazy_feature = (i == 1);
+        config.normalization = normalization;
+        cmdvox::MfccCommander commander;
+        if (!commander.init(config)) { abort(); }
+        feedSegments(&commander, 1000, 0.0f, &frame_nums[i], &values[i]);
+        // A burst too short to be a segment, and a pause that ends just after the VAD falls back to silence
+        feedSegments(&commander, 150, 8000.0f, &frame_nums[i], &values[i]);
+        feedSegments(&commander, 250, 0.0f, &frame_nums[i], &values[i]);
+        feedSegments(&commander, 600, 8000.0f, &frame_nums[i], &values[i]);
+        feedSegments(&commander, 800, 0.0f, &frame_nums[i], &values[i]);
+    }
+    expect(frame_nums[0].size() == 1 && frame_nums[1] == frame_nums[0] && values[1] == values[0],
+        (normalization == cmdvox::FeatureNormalization::Incremental)
+            ? "a lazy segment after a false start equals the eager one (incremental normalization)"
+            : "a lazy segment after a false start equals the eager one");
+}
+
+/**
+ * @brief Statistics that slid over the pre-roll for an hour are recalculated exactly at the onset.
+ */
+void checkStatsRebuild()
+{
+    constexpr int kWindowNum = 30;
+    constexpr int kHopNum = 3600 * 100;
+    std::vector<float> window(kWindowNum * kCoefNum);
+    uint32_t random = 1;
+    auto nextFrame = [&random](float* frame) {
+        for (int k = 0; k < kCoefNum; k++)
+        {
+            random = random * 1103515245 + 12345;
+            frame[k] = 300.0f + static_cast<float>((random >> 16) % 2001 - 1000) / 100.0f;
+        }
+    };
+    cmdvox::FeatureStats idle;
+    idle.init(kCoefNum);
+    for (int i = 0; i < kWindowNum; i++)
+    {
+        nextFrame(&window[i * kCoefNum]);
+        idle.add(&window[i * kCoefNum]);
+    }
+    // The oldest frame is replaced every hop, as the pre-roll is trimmed.
+    for (int n = 0; n < kHopNum; n++)
+    {
+        float* frame = &window[n % kWindowNum * kCoefNum];
+        idle.remove(frame, 1);
+        nextFrame(frame);
+        idle.add(frame);
+    }
+    std::rotate(window.begin(), window.begin() + kHopNum % kWindowNum * kCoefNum, window.end());
+
+    cmdvox::FeatureStats fresh;
+    fresh.init(kCoefNum);
+    for (int i = 0; i < kWindowNum; i++) { fresh.add(&window[i * kCoefNum]); }
+    idle.rebuild(window.data(), kWindowNum);
+    std::vector<int16_t> expected(window.size());
+    std::vector<int16_t> actual(window.size());
+    fresh.normalize(window.data(), kWindowNum, expected.data());
+    idle.normalize(window.data(), kWindowNum, actual.data());
+    expect(actual == expected, "statistics rebuilt after an hour of idle hops equal fresh ones");
+}
+
+/**
+ * @brief An utterance that follows a segment closely keeps its onset with continuous capture.
+ */
+void checkContinuousOnset()
+{
+    auto config = defaultConfig();
+    config.continuous_capture = true;
+    config.vad_config.hangover_ms = 200;
+    // The segments are compared without the silence around them.
+    config.endpoint_trim_db = 20;
+    cmdvox::MfccCommander commander;
+    if (!commander.init(config)) { abort(); }
+    std::vector<int> frame_nums;
+    feedSegments(&commander, 1000, 0.0f, &frame_nums);
+    feedSegments(&commander, 600, 8000.0f, &frame_nums);
+    // The next utterance starts soon after the hangover of the first one.
+    feedSegments(&commander, 250, 0.0f, &frame_nums);
+    feedSegments(&commander, 600, 8000.0f, &frame_nums);
+    feedSegments(&commander, 800, 0.0f, &frame_nums);
+    expect(frame_nums.size() == 2 && frame_nums[1] >= frame_nums[0] - 3, "the onset of a following utterance is captured");
+}
+
+bool flushTrace(cmdvox::TraceWriter* trace, const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) { return false; }
+    const bool is_flushed = trace->flush(file);
+    fclose(file);
+    return is_flushed;
+}
+
+/**
+ * @brief A replay is aligned by a sync record after the ring has dropped the reset, and fails without either.
+ */
+void checkTraceSync()
+{
+    const auto trace_path = rootPath_ + "/self_test_trace.bin";
+    auto config = defaultConfig();
+    // The decimator histories are part of the synchronized state.
+    config.capture_rate = 2 * kSampleRate;
+    config.continuous_capture = true;
+    config.vad_config.hangover_ms = 200;
+
+    // The ring holds about one second of frames, so the reset at the start is dropped.
+    cmdvox::TraceWriter trace;
+    cmdvox::MfccCommander recorder;
+    if (!trace.init(64 * 1024) || !recorder.init(config)) { abort(); }
+    recorder.setTrace(&trace);
+    feedSegments(&recorder, 1000, 0.0f, nullptr);
+    for (int i = 0; i < 4; i++)
+    {
+        feedSegments(&recorder, 600, 8000.0f, nullptr);
+        feedSegments(&recorder, 400, 0.0f, nullptr);
+    }
+    if (!flushTrace(&trace, trace_path)) { abort(); }
+
+    cmdvox::MfccCommander player;
+    if (!player.init(config)) { abort(); }
+    cmdvox::ReplayReport report;
+    const bool is_replayed = cmdvox::replayTrace(trace_path.c_str(), &player, &report);
+    expect(is_replayed && report.skipped_num > 0 && report.frame_num > 0 && report.mismatch_num == 0,
+        "a replay after the ring wrapped is aligned by a sync record");
+
+    // Only silence is left in the ring, so there is nothing to align with.
+    recorder.reset();
+    feedSegments(&recorder, 2000, 0.0f, nullptr);
+    if (!flushTrace(&trace, trace_path)) { abort(); }
+    expect(!cmdvox::replayTrace(trace_path.c_str(), &player, &report), "a replay without a reset or sync record fails");
+    recorder.setTrace(nullptr);
+    trace.deinit();
+}
+
+/**
+ * @brief Returns the gain in dB of a tone decimated by the factor.
+ * @param[in] frequency     tone frequency in the output rate (0.5: Nyquist frequency of the output)
+ */
+float decimatedGain(int factor, float frequency)
+{
+    constexpr int kLength = 480;
+    constexpr float kAmplitude = 16000.0f;
+    cmdvox::Decimator decimator;
+    if (!decimator.init(factor, kLength * factor)) { abort(); }
+    std::vector<int16_t> src(kLength * factor);
+    std::vector<int16_t> dest(kLength);
+    double square = 0.0;
+    for (int block = 0; block < 4; block++)
+    {
+        for (int i = 0; i < kLength * factor; i++)
+        {
+            const int index = block * kLength * factor + i;
+            src[i] = static_cast<int16_t>(kAmplitude * sinf(2.0f * 3.14159265f * frequency * index / factor));
+        }
+        decimator.process(src.data(), kLength * factor, dest.data());
+        // The first block fills the filter history.
+        for (int n = 0; block > 0 && n < kLength; n++)
+        {
+            square += static_cast<double>(dest[n]) * dest[n];
+        }
+    }
+    decimator.deinit();
+    const double rms = sqrt(square / (3 * kLength));
+    return 20.0f * log10f(static_cast<float>(std::max(rms, 1e-3) / (kAmplitude / sqrt(2.0))));
+}
+
+/**
+ * @brief The anti-aliasing filter keeps the speech band and removes tones above the output Nyquist frequency.
+ */
+void checkDecimatorAttenuation()
+{
+    for (const int factor: { 2, 3 })
+    {
+        const float pass_db = decimatedGain(factor, 0.25f);
+        const float nyquist_db = decimatedGain(factor, 0.51f);
+        const float stop_db = decimatedGain(factor, 0.55f);
+        ESP_LOGI(TAG, "decimator x%d: %.1f dB at 0.25, %.1f dB at 0.51, %.1f dB at 0.55", factor, pass_db, nyquist_db, stop_db);
+        expect(fabsf(pass_db) < 0.5f, "decimator passes the speech band");
+        expect(nyquist_db < -60.0f && stop_db < -60.0f, "decimator attenuates tones above the output Nyquist frequency by 60 dB");
+    }
+}
+
+void setup()
+{
+    M5.begin();
+    if (!SD.begin(GPIO_NUM_4, SPI, 25000000, rootPath_.c_str())) { abort(); }
+
+    checkLongJournalRecord();
+    checkCompactionRetry();
+    checkSaveWithJournal();
+    checkManyContexts();
+    checkCopyGeneration();
+    checkEmptyEmbedding();
+    checkLazyFalseStart();
+    checkLazyPreRoll(cmdvox::FeatureNormalization::Engine);
+    checkLazyPreRoll(cmdvox::FeatureNormalization::Incremental);
+    checkStatsRebuild();
+    checkDecimatorAttenuation();
+    checkContinuousOnset();
+    checkTraceSync();
+
+    if (failure_count_ > 0)
+    {
+        ESP_LOGE(TAG, "%d checks failed", failure_count_);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "All checks passed");
+    }
+}
+
+void loop()
+{
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+}
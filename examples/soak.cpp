@@ -0,0 +1,302 @@
+#include <M5Unified.h>
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <math.h>
+#include <SD.h>
+
+#include "cmdvox.h"
+
+constexpr char TAG[] = "Main";
+constexpr int kSampleRate = 16000;
+constexpr int kCommandNum = 10;
+constexpr int kUtteranceNum = 1000000;
+constexpr int kWindowNum = 1000;        // utterances per report
+constexpr int kMutationInterval = 100;  // utterances between bank mutations
+constexpr int kSilenceMs = 600;
+constexpr float kPi = 3.14159265358979f;
+
+/*
+    This is an example of a soak test for long-running devices.
+    Synthetic utterances are detected millions of times while the bank is mutated
+    by add/remove and clear/loadSettings, and every kWindowNum utterances the latency drift,
+    heap fragmentation and allocation counts are reported.
+    It stops with an error if detect allocates once the first window has passed, or if the heap runs out.
+    The heap figures are those of the device, so the soak runs as a sketch, not as a host program.
+*/
+cmdvox::MfccCommander commander_;
+std::string rootPath_ = "/sd";
+std::string settingsPath_;
+int16_t* sample_buffer_;
+int sample_length_;
+TaskHandle_t soak_task_ = nullptr;
+uint32_t alloc_count_ = 0;
+uint32_t alloc_bytes_ = 0;
+uint32_t random_state_ = 1;
+
+struct Utterance
+{
+    int pattern;
+    int sample_index;
+    int voiced_length;
+    int total_length;
+    float phase;
+};
+Utterance utterance_;
+
+struct Window
+{
+    int utterance_count;
+    int64_t detect_us;
+    int64_t max_detect_us;
+    uint32_t detect_alloc_count;
+    uint32_t mutation_alloc_count;
+};
+Window window_ = {};
+cmdvox::DetectResult results_[3];   // reused, so that command_name keeps its capacity
+int utterance_total_ = 0;
+float base_detect_us_ = 0.0f;
+
+void abort()
+{
+    ESP_LOGE(TAG, "aborted");
+    while(true) { vTaskDelay(500 / portTICK_PERIOD_MS); }
+}
+
+// Allocations of the soak task are counted (other tasks allocate on their own).
+void* operator new(size_t size)
+{
+    if (xTaskGetCurrentTaskHandle() == soak_task_)
+    {
+        alloc_count_++;
+        alloc_bytes_ += size;
+    }
+    // Running out of heap is a soak failure, and operator new must not return nullptr.
+    void* ptr = malloc(size);
+    if (ptr == nullptr)
+    {
+        ESP_LOGE(TAG, "FAILED: out of memory for %u bytes", size);
+        abort();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+uint32_t nextRandom()
+{
+    random_state_ ^= random_state_ << 13;
+    random_state_ ^= random_state_ >> 17;
+    random_state_ ^= random_state_ << 5;
+    return random_state_;
+}
+
+void startUtterance(int pattern)
+{
+    // The speaking rate varies by +-20 % between utterances of a pattern.
+    const int base_length = (300 + 40 * pattern) * kSampleRate / 1000;
+    utterance_ = Utterance {
+        .pattern = pattern,
+        .sample_index = 0,
+        .voiced_length = base_length * static_cast<int>(80 + nextRandom() % 41) / 100,
+        .total_length = 0,
+        .phase = 0.0f
+    };
+    utterance_.total_length = utterance_.voiced_length + kSilenceMs * kSampleRate / 1000;
+}
+
+/**
+ * @brief Synthesizes a voiced part whose pitch contour and harmonics depend on the pattern, followed by silence.
+ * @return false when the utterance has ended
+ */
+bool synthesize(int16_t* dest, int length)
+{
+    const int pattern = utterance_.pattern;
+    for (int n = 0; n < length; n++)
+    {
+        const int index = utterance_.sample_index++;
+        float value = static_cast<float>(nextRandom() % 61) - 30.0f;
+        if (index < utterance_.voiced_length)
+        {
+            const float progress = static_cast<float>(index) / utterance_.voiced_length;
+            const float f0 = 120.0f + 15.0f * pattern + 40.0f * sinf(kPi * progress * (1 + pattern % 3));
+            utterance_.phase += 2.0f * kPi * f0 / kSampleRate;
+            if (utterance_.phase > 2.0f * kPi) { utterance_.phase -= 2.0f * kPi; }
+            const float phase = utterance_.phase;
+            value += 8000.0f * sinf(kPi * progress)
+                * (sinf(phase) + 0.5f * sinf((2 + pattern % 4) * phase) + 0.3f * sinf((5 + pattern % 3) * phase));
+        }
+        dest[n] = static_cast<int16_t>(std::max(-32768.0f, std::min(value, 32767.0f)));
+    }
+    return utterance_.sample_index < utterance_.total_length;
+}
+
+std::string featurePath(int pattern)
+{
+    return rootPath_ + "/soak_" + std::to_string(pattern) + ".bin";
+}
+
+/**
+ * @brief Registers one segment of each pattern and saves the settings for loadSettings.
+ */
+void enroll()
+{
+    for (int pattern = 0; pattern < kCommandNum; pattern++)
+    {
+        std::unique_ptr<simplevox::MfccFeature> feature;
+        for (int attempt = 0; attempt < 10 && !feature; attempt++)
+        {
+            startUtterance(pattern);
+            bool is_speaking = true;
+            while (is_speaking && !feature)
+            {
+                is_speaking = synthesize(sample_buffer_, sample_length_);
+                if (commander_.feedSample(sample_buffer_).can_fetch)
+                {
+                    feature = std::move(commander_.fetchFeature().feature);
+                }
+            }
+        }
+        if (!feature)
+        {
+            ESP_LOGE(TAG, "The synthetic utterance was not detected by VAD: %d", pattern);
+            abort();
+        }
+
+        const auto path = featurePath(pattern);
+        if (!cmdvox::MfccCommander::saveFeature(path.c_str(), *feature)) { abort(); }
+        // Every segment is detected, so that each utterance is scored to the end.
+        cmdvox::MfccCommand command {
+            .info = cmdvox::CommandInfo {
+                .name = "soak_" + std::to_string(pattern),
+                .id = 0,
+                .threshold = UINT32_MAX,
+                .path = path
+            },
+            .feature = std::move(feature)
+        };
+        commander_.add(std::move(command));
+    }
+    commander_.saveSettings(settingsPath_);
+    commander_.reset();
+}
+
+/**
+ * @brief Publishes new bank versions by add/remove or clear/loadSettings in turn.
+ */
+void mutateBank(int mutation_index)
+{
+    if (mutation_index % 2 == 0)
+    {
+        const auto path = featurePath(mutation_index / 2 % kCommandNum);
+        cmdvox::MfccCommand command {
+            .info = cmdvox::CommandInfo {
+                .name = "soak_extra",
+                .id = 0,
+                .threshold = UINT32_MAX,
+                .path = path
+            },
+            .feature = std::unique_ptr<simplevox::MfccFeature>(cmdvox::MfccCommander::loadFeature(path.c_str()))
+        };
+        commander_.add(std::move(command));
+        commander_.remove("soak_extra");
+    }
+    else
+    {
+        commander_.clear();
+        commander_.loadSettings(settingsPath_);
+    }
+}
+
+void report()
+{
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+    const float detect_us = static_cast<float>(window_.detect_us) / window_.utterance_count;
+    if (base_detect_us_ == 0.0f) { base_detect_us_ = detect_us; }
+    const float fragmentation = (info.total_free_bytes > 0)
+        ? 100.0f * (1.0f - static_cast<float>(info.largest_free_block) / info.total_free_bytes)
+        : 0.0f;
+
+    ESP_LOGI(TAG, "soak  : %d utterances, detect %.0f us (max %lld us, drift %+.1f %%)",
+        utterance_total_, detect_us, window_.max_detect_us, 100.0f * (detect_us / base_detect_us_ - 1.0f));
+    ESP_LOGI(TAG, "heap  : free %u, largest %u (fragmentation %.1f %%), minimum free %u, blocks %u",
+        info.total_free_bytes, info.largest_free_block, fragmentation, info.minimum_free_bytes, info.allocated_blocks);
+    ESP_LOGI(TAG, "alloc : detect %.3f/utterance, mutation %lu, total %lu (%lu bytes)",
+        static_cast<float>(window_.detect_alloc_count) / window_.utterance_count, window_.mutation_alloc_count,
+        alloc_count_, alloc_bytes_);
+
+    // The first window grows the working storage to the longest segment and template.
+    if (utterance_total_ > kWindowNum && window_.detect_alloc_count > 0)
+    {
+        ESP_LOGE(TAG, "FAILED: detect allocated %lu times in the steady state", window_.detect_alloc_count);
+        abort();
+    }
+    window_ = {};
+}
+
+void setup()
+{
+    cmdvox::CommanderConfig cmdConfig;
+    cmdConfig.vad_config.sample_rate
+    = cmdConfig.mfcc_config.sample_rate
+    = kSampleRate;
+
+    M5.begin();
+    soak_task_ = xTaskGetCurrentTaskHandle();
+    if (!commander_.init(cmdConfig)) { abort(); }
+    sample_length_ = commander_.feed_length();
+    sample_buffer_ = (int16_t*)heap_caps_malloc(sizeof(*sample_buffer_) * sample_length_, MALLOC_CAP_8BIT);
+    if (sample_buffer_ == nullptr) { abort(); }
+
+    if (!SD.begin(GPIO_NUM_4, SPI, 25000000, rootPath_.c_str())) { abort(); }
+    settingsPath_ = rootPath_ + "/soak_settings.json";
+    enroll();
+    startUtterance(0);
+}
+
+void loop()
+{
+    if (utterance_total_ >= kUtteranceNum)
+    {
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        return;
+    }
+
+    if (!synthesize(sample_buffer_, sample_length_))
+    {
+        startUtterance(nextRandom() % kCommandNum);
+    }
+
+    const uint32_t alloc_count = alloc_count_;
+    const auto start = esp_timer_get_time();
+    const int count = commander_.detectNBest(sample_buffer_, results_, 3);
+    const auto detect_us = esp_timer_get_time() - start;
+    window_.detect_alloc_count += alloc_count_ - alloc_count;
+    if (count == 0) { return; }
+
+    utterance_total_++;
+    window_.utterance_count++;
+    window_.detect_us += detect_us;
+    window_.max_detect_us = std::max(window_.max_detect_us, detect_us);
+
+    if (utterance_total_ % kMutationInterval == 0)
+    {
+        const uint32_t mutation_alloc_count = alloc_count_;
+        mutateBank(utterance_total_ / kMutationInterval);
+        window_.mutation_alloc_count += alloc_count_ - mutation_alloc_count;
+    }
+    if (utterance_total_ % kWindowNum == 0)
+    {
+        report();
+    }
+}
@@ -8,13 +8,21 @@
  */
 
 #include "cmdvox.h"
+#include "dtw.h"
+#include "dtw_kernel.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <esp_heap_caps.h>
 #include <esp_log.h>
+#include <esp_pthread.h>
+#include <esp_timer.h>
 
 #include <ArduinoJson.h>
 #include <simplevox.h>
@@ -26,6 +34,13 @@ constexpr char TAG[] = "CMDVOX";
 namespace
 {
 
+constexpr char kJournalSuffix[] = ".journal";
+constexpr char kOldJournalSuffix[] = ".journal.old";
+constexpr char kTempSuffix[] = ".tmp";
+constexpr int kReadChunkLength = 128;
+constexpr int kMinJournalDocSize = 512;
+constexpr int kCompactionStackSize = 8192;
+
 /**
  * @brief 除算を行い演算結果を切り上げます（正の整数）
  * @param[in] dividend  被除数
@@ -37,6 +52,189 @@ constexpr int divCeil(int dividend, int divisor)
   return (dividend + divisor - 1) / divisor;
 }
 
+/**
+ * @brief 入力フレームを間引きます（間引き率1の場合は入力をそのまま返します）
+ */
+const int16_t* decimate(cmdvox::Decimator* decimator, const int16_t* data, int length, int16_t* dest)
+{
+    if (decimator->factor() == 1) { return data; }
+    decimator->process(data, length, dest);
+    return dest;
+}
+
+/**
+ * @brief フレームの対数エネルギー[dB]を計算します
+ */
+float frameEnergy(const int16_t* frame, int length)
+{
+    int64_t sum = 0;
+    for (int i = 0; i < length; i++)
+    {
+        sum += frame[i] * frame[i];
+    }
+    return 10.0f * log10f(static_cast<float>(sum) / length + 1.0f);
+}
+
+/**
+ * @brief ピークからrange_db以内のフレームを含む区間を求めます
+ * @param[out] begin    先頭フレーム
+ * @param[out] end      末尾フレームの次
+ */
+void findEndpoints(const float* energy, int frame_num, float range_db, int margin, int* begin, int* end)
+{
+    if (frame_num <= 0)
+    {
+        *begin = *end = 0;
+        return;
+    }
+    const float threshold = *std::max_element(energy, energy + frame_num) - range_db;
+    int first = 0;
+    while (energy[first] < threshold) { first++; }
+    int last = frame_num - 1;
+    while (energy[last] < threshold) { last--; }
+    *begin = std::max(first - margin, 0);
+    *end = std::min(last + 1 + margin, frame_num);
+}
+
+simplevox::MfccFeature* cloneFeature(const simplevox::MfccFeature& feature)
+{
+    const auto src = cmdvox::viewOf(feature);
+    auto dest = new simplevox::MfccFeature(src.frame_num, src.coef_num);
+    std::copy_n(src.data, src.frame_num * src.coef_num, &dest->feature[0]);
+    return dest;
+}
+
+void printInfo(FILE* file, const cmdvox::CommandInfo& info)
+{
+    fprintf(
+        file,
+        "{\"name\":\"%s\", \"id\":%d, \"threshold\":%lu, \"path\":\"%s\", \"contexts\":[",
+        info.name.c_str(),
+        info.id,
+        info.threshold,
+        info.path.c_str()
+    );
+    for (int i = 0; i < info.contexts.size(); i++)
+    {
+        fprintf(file, (i > 0) ? ", \"%s\"" : "\"%s\"", info.contexts[i].c_str());
+    }
+    fprintf(file, "], \"trim_begin\":%d, \"trim_end\":%d}", info.trim_begin, info.trim_end);
+}
+
+/**
+ * @brief JSONを解析します（容量が足りない場合は倍にして再試行します）
+ * @param[in]  capacity 最初に確保する容量
+ * @param[out] doc      解析結果
+ */
+DeserializationError parseJson(const char* json, size_t capacity, DynamicJsonDocument* doc)
+{
+    // ArduinoJson needs a slot per element besides the text, so many short values can exceed any fixed ratio.
+    *doc = DynamicJsonDocument(capacity);
+    auto error = deserializeJson(*doc, json);
+    while (error == DeserializationError::NoMemory && doc->capacity() > 0)
+    {
+        capacity *= 2;
+        *doc = DynamicJsonDocument(capacity);
+        error = deserializeJson(*doc, json);
+    }
+    return error;
+}
+
+template<class V>
+cmdvox::CommandInfo infoOf(const V& value)
+{
+    cmdvox::CommandInfo info {
+        .name = value["name"],
+        .id = value["id"],
+        .threshold = value["threshold"],
+        .path = value["path"]
+    };
+    auto contexts = value["contexts"].template as<JsonArrayConst>();
+    for (const auto& context : contexts)
+    {
+        info.contexts.push_back(context.template as<std::string>());
+    }
+    // Settings written before the endpoint refinement have no offsets (0).
+    info.trim_begin = value["trim_begin"];
+    info.trim_end = value["trim_end"];
+    return info;
+}
+
+/**
+ * @brief ファイルを書き込み先に確実に反映します
+ */
+void syncFile(FILE* file)
+{
+    fflush(file);
+    fsync(fileno(file));
+}
+
+/**
+ * @brief ファイルを置き換えます（FATは既存ファイルへのrenameに失敗するため削除してから再試行）
+ */
+bool replaceFile(const std::string& from, const std::string& to)
+{
+    if (rename(from.c_str(), to.c_str()) == 0) { return true; }
+    remove(to.c_str());
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+/**
+ * @brief 1行を読み込みます（長さの制限はなく、改行で終わらない行は書き込み途中の末尾です）
+ * @return 読み込んだ文字がない場合はfalse
+ */
+bool readLine(FILE* file, std::string* line)
+{
+    line->clear();
+    char buffer[kReadChunkLength];
+    while (fgets(buffer, sizeof(buffer), file) != NULL)
+    {
+        line->append(buffer);
+        if (line->back() == '\n') { break; }
+    }
+    return !line->empty();
+}
+
+/**
+ * @brief ジャーナルを退避します
+ * @note 前回の圧縮が完了していない場合は、退避済みのジャーナルに追記してから削除します。
+ *       退避済みのジャーナルは、スナップショットが確定するまで削除しません。
+ */
+bool rotateJournal(const std::string& path, const std::string& old_path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) { return true; }
+    if (stat(old_path.c_str(), &info) != 0)
+    {
+        return rename(path.c_str(), old_path.c_str()) == 0;
+    }
+
+    FILE* src = fopen(path.c_str(), "r");
+    FILE* dest = fopen(old_path.c_str(), "a+");
+    if (src == NULL || dest == NULL)
+    {
+        if (src != NULL) { fclose(src); }
+        if (dest != NULL) { fclose(dest); }
+        return false;
+    }
+    // A torn tail of the old journal is closed, so that the appended records are read after it.
+    const bool is_torn = (fseek(dest, -1, SEEK_END) == 0 && fgetc(dest) != '\n');
+    fseek(dest, 0, SEEK_END);
+    if (is_torn) { fputc('\n', dest); }
+    std::string line;
+    bool is_header = true;
+    while (readLine(src, &line))
+    {
+        if (!is_header && line.back() == '\n') { fputs(line.c_str(), dest); }
+        is_header = false;
+    }
+    syncFile(dest);
+    const bool is_written = (ferror(dest) == 0);
+    fclose(dest);
+    fclose(src);
+    return is_written && remove(path.c_str()) == 0;
+}
+
 template<typename T>
 void arr_push_back(const T* src, int n, T* dest, int* length)
 {
@@ -59,13 +257,27 @@ void arr_pop_front(T* arr, int n, int* length)
 namespace cmdvox
 {
 
+MfccCommander::~MfccCommander()
+{
+    closeJournal();
+}
+
 bool MfccCommander::init(const CommanderConfig &config)
+{
+    return init(config, nullptr, dtwKernels<0>());
+}
+
+bool MfccCommander::init(const CommanderConfig &config, const CommanderBuffers *buffers, const DtwKernels &kernels)
 {
     const auto& vad_config = config.vad_config;
     const auto& mfcc_config = config.mfcc_config;
 
-    if (vad_config.sample_rate != mfcc_config.sample_rate)
+    // Each feedSample input is one VAD frame at the capture rate.
+    const int capture_rate = (config.capture_rate > 0) ? config.capture_rate : mfcc_config.sample_rate;
+    if (capture_rate % vad_config.sample_rate != 0 || capture_rate % mfcc_config.sample_rate != 0
+        || (vad_config.frame_time_ms * mfcc_config.sample_rate) % 1000 != 0)
     {
+        ESP_LOGE(TAG, "Unsupported sample rates: capture %d, vad %d, mfcc %d", capture_rate, vad_config.sample_rate, mfcc_config.sample_rate);
         return false;
     }
 
@@ -80,272 +292,1286 @@ bool MfccCommander::init(const CommanderConfig &config)
         return false;
     }
 
-    const int max_length = config.limit_time_ms * vad_config.sample_rate / 1000;
+    if (!initDecimators(config, capture_rate))
+    {
+        ESP_LOGE(TAG, "Decimator init failed");
+        freeDecimators();
+        mfcc_engine_.deinit();
+        vad_engine_.deinit();
+        return false;
+    }
+
+    // The lengths below are in samples at the MFCC rate.
+    const int max_length = config.limit_time_ms * mfcc_config.sample_rate / 1000;
     max_frame_num_ = (max_length - (mfcc_config.frame_length() - mfcc_config.hop_length())) / mfcc_config.hop_length();
-    const int pre_length =
-                vad_config.frame_length() *
-                ( divCeil(vad_config.before_length(), vad_config.frame_length())
-                + divCeil(vad_config.decision_length(), vad_config.frame_length()));
+    const int pre_vad_frame_num =
+                divCeil(vad_config.before_length(), vad_config.frame_length())
+                + divCeil(vad_config.decision_length(), vad_config.frame_length());
+    const int pre_length = mfcc_feed_length_ * pre_vad_frame_num;
     pre_frame_num_ = (pre_length - (mfcc_config.frame_length() - mfcc_config.hop_length())) / mfcc_config.hop_length();
 
-    raw_mfcc_ = (float*)heap_caps_malloc(sizeof(*raw_mfcc_) * max_frame_num_ * mfcc_config.coef_num, MALLOC_CAP_8BIT);
-    raw_max_length_ = std::max(vad_config.frame_length(), mfcc_config.frame_length()) * 2;
-    raw_queue_ = (int16_t*)heap_caps_malloc(sizeof(*raw_queue_) * raw_max_length_, MALLOC_CAP_8BIT);
+    raw_max_length_ = std::max(mfcc_feed_length_, mfcc_config.frame_length()) * 2;
+    if (config.lazy_feature)
+    {
+        raw_max_length_ += std::max(pre_frame_num_, 0) * mfcc_config.hop_length();
+    }
+    if (buffers != nullptr)
+    {
+        if (buffers->raw_queue_length < raw_max_length_ || buffers->raw_mfcc_length < max_frame_num_ * mfcc_config.coef_num)
+        {
+            ESP_LOGE(TAG, "Buffers are too small: %d, %d", buffers->raw_queue_length, buffers->raw_mfcc_length);
+            freeDecimators();
+            mfcc_engine_.deinit();
+            vad_engine_.deinit();
+            return false;
+        }
+        raw_queue_ = buffers->raw_queue;
+        raw_mfcc_ = buffers->raw_mfcc;
+        query_feature_ = buffers->query_feature;
+        owns_buffers_ = false;
+    }
+    else
+    {
+        raw_mfcc_ = (float*)heap_caps_malloc(sizeof(*raw_mfcc_) * max_frame_num_ * mfcc_config.coef_num, MALLOC_CAP_8BIT);
+        raw_queue_ = (int16_t*)heap_caps_malloc(sizeof(*raw_queue_) * raw_max_length_, MALLOC_CAP_8BIT);
+        // The fetched segment is normalized here, so that detect does not allocate a feature.
+        query_feature_ = (int16_t*)heap_caps_malloc(sizeof(*query_feature_) * max_frame_num_ * mfcc_config.coef_num, MALLOC_CAP_8BIT);
+        owns_buffers_ = true;
+    }
+    if (config.continuous_capture)
+    {
+        // The completed segment and the next one are captured alternately in the two buffers.
+        segment_buffer_ = (float*)heap_caps_malloc(sizeof(*segment_buffer_) * max_frame_num_ * mfcc_config.coef_num, MALLOC_CAP_8BIT);
+        ready_mfcc_ = segment_buffer_;
+    }
+    if (config.endpoint_trim_db > 0)
+    {
+        // Two halves when the completed segment is handed off
+        const int buffer_num = config.continuous_capture ? 2 : 1;
+        energy_buffer_ = (float*)heap_caps_malloc(sizeof(*energy_buffer_) * max_frame_num_ * buffer_num, MALLOC_CAP_8BIT);
+        frame_energy_ = energy_buffer_;
+        ready_energy_ = (energy_buffer_ != nullptr && config.continuous_capture) ? &energy_buffer_[max_frame_num_] : nullptr;
+    }
+    if (config.spotting)
+    {
+        spot_feature_ = (int16_t*)heap_caps_malloc(sizeof(*spot_feature_) * mfcc_config.coef_num, MALLOC_CAP_8BIT);
+    }
+    if (config.gate_level > 0)
+    {
+        // The gate retains the pre-roll of the VAD so that onsets are not clipped.
+        gate_frame_num_ = std::max(pre_vad_frame_num, 1);
+        gate_hold_count_ = divCeil(config.gate_hold_ms * vad_config.sample_rate / 1000, vad_config.frame_length());
+        gate_queue_ = (int16_t*)heap_caps_malloc(sizeof(*gate_queue_) * gate_frame_num_ * frame_length_, MALLOC_CAP_8BIT);
+    }
     
-    if (raw_mfcc_ == nullptr || raw_queue_ == nullptr)
+    if (raw_mfcc_ == nullptr || raw_queue_ == nullptr || query_feature_ == nullptr
+        || (config.continuous_capture && segment_buffer_ == nullptr)
+        || (config.endpoint_trim_db > 0 && energy_buffer_ == nullptr)
+        || (config.spotting && spot_feature_ == nullptr)
+        || (config.gate_level > 0 && gate_queue_ == nullptr))
     {
-        if (raw_queue_ != nullptr)
+        if (gate_queue_ != nullptr)
         {
-            heap_caps_free(raw_queue_);
-            raw_queue_ = nullptr;
+            heap_caps_free(gate_queue_);
+            gate_queue_ = nullptr;
         }
-        if (raw_mfcc_ != nullptr)
+        if (spot_feature_ != nullptr)
         {
-            heap_caps_free(raw_mfcc_);
-            raw_mfcc_ = nullptr;
+            heap_caps_free(spot_feature_);
+            spot_feature_ = nullptr;
         }
+        freeBuffers();
+        freeDecimators();
         mfcc_engine_.deinit();
         vad_engine_.deinit();
         return false;
     }
 
-    frame_length_ = vad_config.frame_length();
+    kernels_ = &kernels;
     config_ = config;
+    feature_stats_.init(mfcc_config.coef_num);
+    ready_stats_.init(mfcc_config.coef_num);
+    query_embedding_.resize(EmbeddingIndex::lengthOf(mfcc_config.coef_num));
+
+    // The templates derived from the previous config are rebuilt.
+    modifyBank([this](CommandBank* bank) {
+        for (auto& entry: bank->commands)
+        {
+            const auto& data = *entry.data;
+            entry.data = data.quantized_feature
+                ? prepare(nullptr, std::unique_ptr<QuantizedFeature>(new QuantizedFeature(*data.quantized_feature)))
+                : prepare(std::unique_ptr<simplevox::MfccFeature>(cloneFeature(*data.feature)), nullptr);
+        }
+    });
+    // The DTW scratch is sized up front for the longest query and template.
+    scratch_.reserve(max_frame_num_, std::atomic_load(&bank_)->max_frame_num, config_.coarse_factor);
     reset();
     return true;
 }
 
 void MfccCommander::deinit()
 {
-    if (raw_queue_ != nullptr)
+    if (gate_queue_ != nullptr)
     {
-        heap_caps_free(raw_queue_);
-        raw_queue_ = nullptr;
+        heap_caps_free(gate_queue_);
+        gate_queue_ = nullptr;
     }
-    if (raw_mfcc_ != nullptr)
+    if (spot_feature_ != nullptr)
     {
-        heap_caps_free(raw_mfcc_);
-        raw_mfcc_ = nullptr;
+        heap_caps_free(spot_feature_);
+        spot_feature_ = nullptr;
     }
+    freeBuffers();
+    freeDecimators();
     mfcc_engine_.deinit();
     vad_engine_.deinit();
 }
 
+void MfccCommander::freeBuffers()
+{
+    // raw_mfcc_ holds the segment buffer after an odd number of hand-offs.
+    if (segment_buffer_ != nullptr && raw_mfcc_ == segment_buffer_)
+    {
+        std::swap(raw_mfcc_, ready_mfcc_);
+    }
+    if (segment_buffer_ != nullptr)
+    {
+        heap_caps_free(segment_buffer_);
+        segment_buffer_ = nullptr;
+    }
+    ready_mfcc_ = nullptr;
+    if (energy_buffer_ != nullptr)
+    {
+        heap_caps_free(energy_buffer_);
+        energy_buffer_ = nullptr;
+    }
+    frame_energy_ = nullptr;
+    ready_energy_ = nullptr;
+    // The buffers given by a specialized commander are not freed.
+    if (owns_buffers_ && raw_queue_ != nullptr)
+    {
+        heap_caps_free(raw_queue_);
+    }
+    if (owns_buffers_ && raw_mfcc_ != nullptr)
+    {
+        heap_caps_free(raw_mfcc_);
+    }
+    if (owns_buffers_ && query_feature_ != nullptr)
+    {
+        heap_caps_free(query_feature_);
+    }
+    raw_queue_ = nullptr;
+    raw_mfcc_ = nullptr;
+    query_feature_ = nullptr;
+}
+
+bool MfccCommander::initDecimators(const CommanderConfig& config, int capture_rate)
+{
+    freeDecimators();
+    const auto& vad_config = config.vad_config;
+    frame_length_ = vad_config.frame_time_ms * capture_rate / 1000;
+    mfcc_feed_length_ = vad_config.frame_time_ms * config.mfcc_config.sample_rate / 1000;
+
+    // The decimated frames are written to own buffers only when the rate differs from the capture rate.
+    const int vad_factor = capture_rate / vad_config.sample_rate;
+    const int mfcc_factor = capture_rate / config.mfcc_config.sample_rate;
+    if (vad_factor > 1)
+    {
+        vad_frame_ = (int16_t*)heap_caps_malloc(sizeof(*vad_frame_) * vad_config.frame_length(), MALLOC_CAP_8BIT);
+        if (vad_frame_ == nullptr || !vad_decimator_.init(vad_factor, frame_length_)) { return false; }
+    }
+    if (mfcc_factor > 1)
+    {
+        mfcc_frame_ = (int16_t*)heap_caps_malloc(sizeof(*mfcc_frame_) * mfcc_feed_length_, MALLOC_CAP_8BIT);
+        if (mfcc_frame_ == nullptr || !mfcc_decimator_.init(mfcc_factor, frame_length_)) { return false; }
+    }
+    return true;
+}
+
+void MfccCommander::freeDecimators()
+{
+    if (vad_frame_ != nullptr)
+    {
+        heap_caps_free(vad_frame_);
+        vad_frame_ = nullptr;
+    }
+    if (mfcc_frame_ != nullptr)
+    {
+        heap_caps_free(mfcc_frame_);
+        mfcc_frame_ = nullptr;
+    }
+    vad_decimator_.deinit();
+    mfcc_decimator_.deinit();
+}
+
 void MfccCommander::reset()
 {
     raw_length_ = 0;
     frame_count_ = 0;
+    ready_frame_num_ = 0;
+    is_skipping_ = false;
+    is_vad_restarted_ = false;
+    feature_stats_.clear();
     vad_engine_.reset();
     vad_state_ = simplevox::VadState::Warmup;
+    gate_open_ = true;
+    gate_head_ = 0;
+    gate_count_ = 0;
+    gate_silence_count_ = 0;
+    spot_frame_index_ = 0;
+    for (auto& spotter: spotters_)
+    {
+        spotter.reset();
+    }
+    if (trace_ != nullptr) { trace_->writeReset(); }
 }
 
 void MfccCommander::add(MfccCommand &&command)
 {
-    for (auto& cmd: commands)
-    {
-        if (cmd.info.id == command.info.id
-            && cmd.info.name.compare(command.info.name) == 0)
-        {
-            ESP_LOGI(TAG, "Swap and Add command: %s", command.info.name.c_str());
-            std::swap(cmd, command);
-            return;
-        }
-    }
-
-    ESP_LOGI(TAG, "Add command: %s", command.info.name.c_str());
-    commands.push_back(std::move(command));
+    modifyBank([&](CommandBank* bank) {
+        appendJournal(JournalOp::Add, command.info.name, command.info.id, &command.info);
+        addTo(bank, std::move(command));
+    });
 }
 
 void MfccCommander::remove(const std::string &name, int id)
 {
-    for (auto it = commands.begin(); it != commands.end();)
-    {
-        if ((*it).info.name.compare(name))
-        {
-            if (id < 0 || id == (*it).info.id)
-            {
-                it = commands.erase(it);
-            }
-        }
-        else
-        {
-            ++it;
-        }
-    }
+    modifyBank([&](CommandBank* bank) {
+        appendJournal(JournalOp::Remove, name, id, nullptr);
+        removeFrom(bank, name, id);
+    });
 }
 
 void MfccCommander::modifyInfo(const std::string &name, int id, const CommandInfo &info)
 {
-    for (auto& command: commands)
-    {
-        if (command.info.name == name && command.info.id == id)
-        {
-            command.info = info;
-            break;
-        }
-    }
+    modifyBank([&](CommandBank* bank) {
+        appendJournal(JournalOp::Modify, name, id, &info);
+        modifyIn(bank, name, id, info);
+    });
 }
 
 void MfccCommander::clear()
 {
-    commands.clear();
+    modifyBank([this](CommandBank* bank) {
+        appendJournal(JournalOp::Clear, "", 0, nullptr);
+        bank->commands.clear();
+    });
+}
+
+void MfccCommander::activateContexts(const std::vector<std::string> &contexts)
+{
+    modifyBank([&](CommandBank* bank) {
+        bank->active_contexts = contexts;
+    });
 }
 
 void MfccCommander::saveSettings(const std::string &path)
 {
+    if (compaction_.joinable())
+    {
+        compaction_.join();
+    }
+    // The journaled settings are saved by compaction, so that the journal restarts after the snapshot.
+    if (journal_ != nullptr && path == journal_path_)
+    {
+        is_compacting_ = true;
+        compact();
+        return;
+    }
+
+    // Only the journal's own snapshot is stamped, so that the journals of another path are not skipped on load.
+    std::shared_ptr<const CommandBank> bank;
+    uint32_t generation = 0;
+    {
+        std::lock_guard<std::mutex> lock(bank_mutex_);
+        bank = std::atomic_load(&bank_);
+        if (path == journal_path_) { generation = journal_generation_; }
+    }
     FILE* file = fopen(path.c_str(), "w");
     if (file == NULL) { return; }
 
-    fprintf(file, "{\"%s\":[", NameOf(commands));
+    writeSettings(file, *bank, generation);
+    fclose(file);
+}
+
+void MfccCommander::writeSettings(FILE *file, const CommandBank &bank, uint32_t generation)
+{
+    const auto& commands = bank.commands;
+    fprintf(file, "{\"generation\":%lu, \"%s\":[", generation, NameOf(commands));
     for(int i = 0; i < commands.size(); i++)
     {
-        const auto& command = commands[i];
         if(i > 0) { fprintf(file, ",\n"); }
-        fprintf(
-            file,
-            "{\"name\":\"%s\", \"id\":%d, \"threshold\":%lu, \"path\":\"%s\"}",
-            command.info.name.c_str(),
-            command.info.id,
-            command.info.threshold,
-            command.info.path.c_str()
-        );
+        printInfo(file, commands[i].info);
     }
     fprintf(file, "]}");
-    fclose(file);
 }
 
 void MfccCommander::loadSettings(const std::string &path)
 {
+    // The settings file is followed by the journals not merged into it yet.
+    std::vector<JournalRecord> records;
+    uint32_t generation = 0;
+    readSettings(path, &records, &generation);
+    readJournal(path + kOldJournalSuffix, &records, &generation);
+    readJournal(path + kJournalSuffix, &records, &generation);
+
+    for (auto& record: records)
+    {
+        if (record.op != JournalOp::Add) { continue; }
+
+        auto& command = record.command;
+        ESP_LOGI(TAG, "Add command: %s", command.info.name.c_str());
+        command.quantized_feature = std::unique_ptr<QuantizedFeature>(loadQuantizedFeature(command.info.path.c_str()));
+        if (!command.quantized_feature)
+        {
+            command.feature = std::unique_ptr<simplevox::MfccFeature>(loadFeature(command.info.path.c_str()));
+        }
+    }
+
+    // All commands are loaded before the bank is published once.
+    modifyBank([&](CommandBank* bank) {
+        for (auto& record: records)
+        {
+            switch (record.op)
+            {
+            case JournalOp::Add: addTo(bank, std::move(record.command)); break;
+            case JournalOp::Remove: removeFrom(bank, record.name, record.id); break;
+            case JournalOp::Modify: modifyIn(bank, record.name, record.id, record.command.info); break;
+            case JournalOp::Clear: bank->commands.clear(); break;
+            }
+        }
+        journal_generation_ = std::max(journal_generation_, generation);
+    });
+}
+
+bool MfccCommander::readSettings(const std::string &path, std::vector<JournalRecord> *records, uint32_t *generation)
+{
+    // The settings are left in the temporary file if compaction stopped between remove and rename.
+    std::string settings_path = path;
     struct stat info;
-    if (stat(path.c_str(), &info) != 0)
+    if (stat(settings_path.c_str(), &info) != 0)
     {
-        ESP_LOGE(TAG, "stat() failed: %d", errno);
-        return;
+        settings_path = path + kTempSuffix;
+        if (stat(settings_path.c_str(), &info) != 0)
+        {
+            ESP_LOGE(TAG, "stat() failed: %d", errno);
+            return false;
+        }
     }
 
     const auto file_size = info.st_size;
     std::unique_ptr<char[]> file_str(new char[file_size + 1]);
-    FILE* file = fopen(path.c_str(), "r");
+    FILE* file = fopen(settings_path.c_str(), "r");
     const auto length = fread(file_str.get(), sizeof(*file_str.get()), file_size, file);
     file_str[length] = '\0';
+    fclose(file);
 
-    DynamicJsonDocument doc(2 * file_size);
-    auto error = deserializeJson(doc, file_str.get());
+    DynamicJsonDocument doc(0);
+    auto error = parseJson(file_str.get(), 2 * file_size, &doc);
     if (error)
     {
         ESP_LOGE(TAG, "deserializeJson failed: %s", error.c_str());
+        return false;
     }
-    else
+
+    *generation = doc["generation"];
+    auto arr = doc["commands"].as<JsonArray>();
+    for (const auto& value : arr)
+    {
+        JournalRecord record { .op = JournalOp::Add };
+        record.command.info = infoOf(value);
+        records->push_back(std::move(record));
+    }
+    return true;
+}
+
+bool MfccCommander::readJournal(const std::string &path, std::vector<JournalRecord> *records, uint32_t *generation)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == NULL) { return false; }
+
+    std::string line;
+    bool is_header = true;
+    while (readLine(file, &line))
     {
-        auto arr = doc[NameOf(commands)].as<JsonArray>();
-        for (const auto& value : arr)
+        // A record torn by power loss has no line end, and it can only be the last one.
+        if (line.back() != '\n')
+        {
+            ESP_LOGW(TAG, "Torn journal record: %s", path.c_str());
+            break;
+        }
+        DynamicJsonDocument doc(0);
+        if (parseJson(line.c_str(), std::max<size_t>(2 * line.size(), kMinJournalDocSize), &doc))
         {
-            MfccCommand command {
-                .info {
-                    .name = value["name"],
-                    .id = value["id"],
-                    .threshold = value["threshold"],
-                    .path = value["path"]
-                }
-            };
-            ESP_LOGI(TAG, "Add command: %s", command.info.name.c_str());
+            ESP_LOGW(TAG, "Broken journal record: %s", path.c_str());
+            if (is_header) { break; }
+            continue;
+        }
 
-            command.feature = std::unique_ptr<simplevox::MfccFeature>(loadFeature(command.info.path.c_str()));
-            add(std::move(command));
+        if (is_header)
+        {
+            // A journal already merged into the settings is skipped.
+            const uint32_t journal_generation = doc["generation"];
+            if (journal_generation <= *generation) { break; }
+            *generation = journal_generation;
+            is_header = false;
+            continue;
+        }
+
+        const std::string op = doc["op"];
+        JournalRecord record {
+            .op = JournalOp::Clear,
+            .name = doc["name"],
+            .id = doc["id"]
+        };
+        if (op == "add") { record.op = JournalOp::Add; }
+        else if (op == "remove") { record.op = JournalOp::Remove; }
+        else if (op == "modify") { record.op = JournalOp::Modify; }
+        if (record.op == JournalOp::Add || record.op == JournalOp::Modify)
+        {
+            record.command.info = infoOf(doc["info"]);
         }
+        records->push_back(std::move(record));
     }
 
     fclose(file);
+    return true;
 }
 
-FeedResult MfccCommander::feedSample(const int16_t *data)
+bool MfccCommander::openJournal(const std::string &path, long limit)
 {
-    FeedResult result {
-        .can_fetch = can_fetch()
-    };
+    closeJournal();
+    journal_path_ = path;
+    journal_limit_ = limit;
+    journal_ = fopen((path + kJournalSuffix).c_str(), "a");
 
-    if (can_fetch()) { return  result; }
+    // The settings are rewritten at once, which also drops a torn tail of the previous journal.
+    is_compacting_ = true;
+    compact();
+    return (journal_ != nullptr);
+}
 
-    const int vad_frame_length = config_.vad_config.frame_length();
-    const int mfcc_frame_length = config_.mfcc_config.frame_length();
-    const int mfcc_hop_length = config_.mfcc_config.hop_length();
-    const int mfcc_coef_num = config_.mfcc_config.coef_num;
+void MfccCommander::closeJournal()
+{
+    if (compaction_.joinable())
+    {
+        compaction_.join();
+    }
 
-    const auto state = vad_state_ = vad_engine_.process(data);
-    if (state >= simplevox::VadState::Silence)
+    std::lock_guard<std::mutex> lock(bank_mutex_);
+    if (journal_ != nullptr)
     {
-        arr_push_back(data, vad_frame_length, raw_queue_, &raw_length_);
+        fclose(journal_);
+        journal_ = nullptr;
     }
+}
 
-    while (raw_length_ >= mfcc_frame_length)
+void MfccCommander::appendJournal(JournalOp op, const std::string &name, int id, const CommandInfo *info)
+{
+    // Called while bank_mutex_ is held, so the records are in the order of the published versions.
+    if (journal_ == nullptr) { return; }
+
+    static constexpr const char* kOpNames[] = { "add", "remove", "modify", "clear" };
+    fprintf(journal_, "{\"op\":\"%s\", \"name\":\"%s\", \"id\":%d", kOpNames[static_cast<int>(op)], name.c_str(), id);
+    if (info != nullptr)
     {
-        if (frame_count_ < max_frame_num_)
+        fprintf(journal_, ", \"info\":");
+        printInfo(journal_, *info);
+    }
+    fprintf(journal_, "}\n");
+    syncFile(journal_);
+
+    if (ftell(journal_) > journal_limit_ && !is_compacting_)
+    {
+        is_compacting_ = true;
+        if (compaction_.joinable())
         {
-            mfcc_engine_.calculate(raw_queue_, &raw_mfcc_[frame_count_ * mfcc_coef_num]);
-            frame_count_++;
+            compaction_.join();
         }
-        arr_pop_front(raw_queue_, mfcc_hop_length, &raw_length_);
+        // fprintf and fsync on FAT need more stack than the default pthread one.
+        auto thread_config = esp_pthread_get_default_config();
+        thread_config.stack_size = kCompactionStackSize;
+        thread_config.thread_name = "cmdvox_compact";
+        esp_pthread_set_cfg(&thread_config);
+        compaction_ = std::thread(&MfccCommander::compact, this);
+        // Threads created later by the caller get the default config again.
+        thread_config = esp_pthread_get_default_config();
+        esp_pthread_set_cfg(&thread_config);
     }
+}
 
-    if (state < simplevox::VadState::Speech && frame_count_ > pre_frame_num_)
+void MfccCommander::compact()
+{
+    if (!writeSnapshot())
     {
-        const int over_count = frame_count_ - pre_frame_num_;
-        const int over_length = over_count * mfcc_coef_num;
-        int length = frame_count_ * mfcc_coef_num;
-        arr_pop_front(raw_mfcc_, over_length, &length);
-        frame_count_ -= over_count;
+        ESP_LOGE(TAG, "Failed to compact: %s", journal_path_.c_str());
     }
-
-    result.can_fetch = can_fetch();
-    return result;
+    // Compaction is tried again by the next append even after a failure.
+    is_compacting_ = false;
 }
 
-FetchResult MfccCommander::fetchFeature()
+bool MfccCommander::writeSnapshot()
 {
-    FetchResult result;
-    if (can_fetch())
+    std::shared_ptr<const CommandBank> bank;
+    uint32_t generation;
     {
-        result.feature = std::unique_ptr<simplevox::MfccFeature>(mfcc_engine_.create(raw_mfcc_, frame_count_, mfcc_engine_.config().coef_num));
-        reset();
-        return result;
+        // The journal is rotated, so that records are appended to a new one while the snapshot is written.
+        std::lock_guard<std::mutex> lock(bank_mutex_);
+        bank = std::atomic_load(&bank_);
+        generation = journal_generation_;
+        if (journal_ != nullptr)
+        {
+            fclose(journal_);
+            journal_ = nullptr;
+        }
+        const auto path = journal_path_ + kJournalSuffix;
+        if (!rotateJournal(path, journal_path_ + kOldJournalSuffix))
+        {
+            // The records stay in the current journal, and appending continues there.
+            journal_ = fopen(path.c_str(), "a");
+            return false;
+        }
+        journal_generation_++;
+        journal_ = fopen(path.c_str(), "w");
+        if (journal_ != nullptr)
+        {
+            fprintf(journal_, "{\"generation\":%lu}\n", journal_generation_);
+            syncFile(journal_);
+        }
+    }
+
+    // The old journal is kept until the snapshot is durable.
+    const auto temp_path = journal_path_ + kTempSuffix;
+    FILE* file = fopen(temp_path.c_str(), "w");
+    if (file == NULL) { return false; }
+    writeSettings(file, *bank, generation);
+    syncFile(file);
+    const bool is_written = (ferror(file) == 0);
+    fclose(file);
+    if (!is_written || !replaceFile(temp_path, journal_path_)) { return false; }
+
+    ::remove((journal_path_ + kOldJournalSuffix).c_str());
+    return true;
+}
+
+FeedResult MfccCommander::feedSample(const int16_t *data)
+{
+    stats_.vad_us = 0;
+    stats_.mfcc_us = 0;
+    stats_.fetch_us = 0;
+    stats_.score_us = 0;
+    is_vad_restarted_ = false;
+    // The pipeline waits for the fetch unless a completed segment can be handed off.
+    if (config_.continuous_capture || !can_fetch())
+    {
+        feed(data);
+    }
+
+    stats_.vad_state = vad_state_;
+    stats_.gate_open = gate_open_;
+    stats_.frame_count = frame_count_;
+    stats_.raw_length = raw_length_;
+    stats_.can_fetch = can_fetch();
+    if (trace_ != nullptr)
+    {
+        trace_->writeFrame(stats_, data, frame_length_);
+        // A pending segment is not part of the state, so the sync waits until it is fetched.
+        if (is_vad_restarted_ && ready_frame_num_ == 0) { writeSync(); }
+    }
+
+    FeedResult result {
+        .can_fetch = stats_.can_fetch
+    };
+    return result;
+}
+
+void MfccCommander::feed(const int16_t *data)
+{
+    if (gate_queue_ == nullptr)
+    {
+        process(data);
+        return;
+    }
+
+    if (!gate_open_)
+    {
+        const auto gate_start = esp_timer_get_time();
+        const bool is_tripped = isGateTripped(data);
+        stats_.vad_us += esp_timer_get_time() - gate_start;
+        if (!is_tripped)
+        {
+            // The oldest frame is overwritten once the pre-roll is full.
+            const int tail = (gate_head_ + gate_count_) % gate_frame_num_;
+            std::copy_n(data, frame_length_, &gate_queue_[tail * frame_length_]);
+            if (gate_count_ < gate_frame_num_) { gate_count_++; }
+            else { gate_head_ = (gate_head_ + 1) % gate_frame_num_; }
+            return;
+        }
+
+        // The retained pre-roll is fed first as if the pipeline had been running.
+        gate_open_ = true;
+        gate_silence_count_ = 0;
+        for (int i = 0; i < gate_count_; i++)
+        {
+            process(&gate_queue_[((gate_head_ + i) % gate_frame_num_) * frame_length_]);
+        }
+        gate_head_ = 0;
+        gate_count_ = 0;
+    }
+
+    process(data);
+    gate_silence_count_ = (vad_state_ == simplevox::VadState::Silence) ? gate_silence_count_ + 1 : 0;
+    if (gate_silence_count_ >= gate_hold_count_)
+    {
+        // The pre-roll is dropped since the next onset comes after a gap.
+        gate_open_ = false;
+        vad_decimator_.reset();
+        mfcc_decimator_.reset();
+        raw_length_ = 0;
+        frame_count_ = 0;
+        feature_stats_.clear();
+    }
+}
+
+bool MfccCommander::isGateTripped(const int16_t *data)
+{
+    const int length = frame_length_;
+    int32_t level = 0;
+    int zero_cross = 0;
+    for (int i = 0; i < length; i++)
+    {
+        level += abs(data[i]);
+        if (i > 0 && (data[i - 1] < 0) != (data[i] < 0)) { zero_cross++; }
+    }
+    level /= length;
+
+    // Weak fricative onsets are caught by the zero-crossing rate at a lower level.
+    // The crossings are counted at the capture rate and compared per 1000 samples at the VAD rate.
+    return level >= config_.gate_level
+        || (level * 2 >= config_.gate_level && zero_cross * 1000 >= config_.gate_zero_cross * config_.vad_config.frame_length());
+}
+
+void MfccCommander::process(const int16_t *data)
+{
+    const int mfcc_frame_length = config_.mfcc_config.frame_length();
+    const int mfcc_hop_length = config_.mfcc_config.hop_length();
+    const int mfcc_coef_num = config_.mfcc_config.coef_num;
+
+    const auto vad_start = esp_timer_get_time();
+    const auto last_state = vad_state_;
+    // Only a restart in the last processed frame leaves the VAD fresh at the end of the feed.
+    is_vad_restarted_ = false;
+    auto state = vad_state_ = vad_engine_.process(decimate(&vad_decimator_, data, frame_length_, vad_frame_));
+    if (config_.continuous_capture && state == simplevox::VadState::Detected && last_state == simplevox::VadState::Detected)
+    {
+        // A VAD that holds Detected until reset is restarted for the next segment.
+        vad_engine_.reset();
+        state = vad_state_ = simplevox::VadState::Warmup;
+        is_vad_restarted_ = true;
+    }
+    const auto mfcc_start = esp_timer_get_time();
+    stats_.vad_us += mfcc_start - vad_start;
+    if (is_skipping_)
+    {
+        is_skipping_ = (state >= simplevox::VadState::Speech && state != simplevox::VadState::Detected);
+        return;
+    }
+    // With continuous capture the samples keep flowing while a restarted VAD warms up,
+    // so that an utterance starting right after a segment keeps its onset in the pre-roll.
+    if (state >= simplevox::VadState::Silence || config_.continuous_capture)
+    {
+        arr_push_back(decimate(&mfcc_decimator_, data, frame_length_, mfcc_frame_), mfcc_feed_length_, raw_queue_, &raw_length_);
+    }
+
+    if (config_.lazy_feature && state < simplevox::VadState::Speech)
+    {
+        // The pre-roll is the frames left by a false start followed by the samples of the frames not calculated yet.
+        // Only samples are added until speech starts, and the oldest frames are dropped first as in eager mode.
+        const int sample_frame_num = (raw_length_ >= mfcc_frame_length) ? (raw_length_ - mfcc_frame_length) / mfcc_hop_length + 1 : 0;
+        const int over_count = frame_count_ + sample_frame_num - pre_frame_num_;
+        if (over_count > 0)
+        {
+            const int frame_over_count = std::min(over_count, frame_count_);
+            dropFrames(frame_over_count);
+            arr_pop_front(raw_queue_, (over_count - frame_over_count) * mfcc_hop_length, &raw_length_);
+        }
+        return;
+    }
+
+    if (config_.normalization == FeatureNormalization::Incremental
+        && state >= simplevox::VadState::Speech && last_state < simplevox::VadState::Speech)
+    {
+        // The sums go through an add and a remove every hop while idle, so their float rounding
+        // would build up for hours. They are recalculated from the pre-roll frames at each onset.
+        feature_stats_.rebuild(raw_mfcc_, frame_count_);
+    }
+    while (raw_length_ >= mfcc_frame_length)
+    {
+        if (frame_count_ < max_frame_num_)
+        {
+            if (frame_energy_ != nullptr)
+            {
+                frame_energy_[frame_count_] = frameEnergy(raw_queue_, mfcc_frame_length);
+            }
+            mfcc_engine_.calculate(raw_queue_, &raw_mfcc_[frame_count_ * mfcc_coef_num]);
+            if (config_.normalization == FeatureNormalization::Incremental)
+            {
+                feature_stats_.add(&raw_mfcc_[frame_count_ * mfcc_coef_num]);
+            }
+            frame_count_++;
+        }
+        arr_pop_front(raw_queue_, mfcc_hop_length, &raw_length_);
+    }
+
+    if (state < simplevox::VadState::Speech && frame_count_ > pre_frame_num_)
+    {
+        dropFrames(frame_count_ - pre_frame_num_);
+    }
+    if (config_.continuous_capture)
+    {
+        handOff(state);
+    }
+    stats_.mfcc_us += esp_timer_get_time() - mfcc_start;
+}
+
+void MfccCommander::dropFrames(int count)
+{
+    if (count <= 0) { return; }
+
+    const int coef_num = config_.mfcc_config.coef_num;
+    if (config_.normalization == FeatureNormalization::Incremental)
+    {
+        feature_stats_.remove(raw_mfcc_, count);
+    }
+    int length = frame_count_ * coef_num;
+    arr_pop_front(raw_mfcc_, count * coef_num, &length);
+    if (frame_energy_ != nullptr)
+    {
+        int energy_length = frame_count_;
+        arr_pop_front(frame_energy_, count, &energy_length);
+    }
+    frame_count_ -= count;
+}
+
+void MfccCommander::handOff(simplevox::VadState state)
+{
+    const bool is_limited = (state >= simplevox::VadState::Speech && max_frame_num_ <= frame_count_);
+    if (state != simplevox::VadState::Detected && !is_limited) { return; }
+
+    if (ready_frame_num_ > 0)
+    {
+        ESP_LOGW(TAG, "Segment of %d frames was not fetched", ready_frame_num_);
+    }
+    // The frames are handed off by swapping the buffers, so the next segment starts at once.
+    std::swap(raw_mfcc_, ready_mfcc_);
+    std::swap(frame_energy_, ready_energy_);
+    std::swap(feature_stats_, ready_stats_);
+    ready_frame_num_ = frame_count_;
+    frame_count_ = 0;
+    feature_stats_.clear();
+    // The rest of an utterance cut by the limit is not a segment of its own, and none of its samples are kept.
+    is_skipping_ = is_limited && state != simplevox::VadState::Detected;
+    if (is_skipping_)
+    {
+        raw_length_ = 0;
+        mfcc_decimator_.reset();
+    }
+}
+
+void MfccCommander::writeSync()
+{
+    const int coef_num = config_.mfcc_config.coef_num;
+    const TraceSync sync {
+        .raw_length = static_cast<uint16_t>(raw_length_),
+        .frame_count = static_cast<uint16_t>(frame_count_),
+        .coef_num = static_cast<uint16_t>(coef_num),
+        .vad_history_length = static_cast<uint16_t>(vad_decimator_.history_length()),
+        .mfcc_history_length = static_cast<uint16_t>(mfcc_decimator_.history_length()),
+        .has_energy = (frame_energy_ != nullptr),
+        .reserved = 0
+    };
+    trace_->writeSync(sync, raw_queue_, vad_decimator_.history(), mfcc_decimator_.history(), raw_mfcc_, frame_energy_);
+}
+
+bool MfccCommander::restoreSync(const TraceRecord& record)
+{
+    const auto& sync = record.sync;
+    const int coef_num = config_.mfcc_config.coef_num;
+    const int history_length = sync.vad_history_length + sync.mfcc_history_length;
+    const int frame_length = sync.frame_count * coef_num * sizeof(float) / sizeof(int16_t);
+    const int energy_length = sync.has_energy ? sync.frame_count * sizeof(float) / sizeof(int16_t) : 0;
+    if (sync.coef_num != coef_num || sync.raw_length > raw_max_length_ || sync.frame_count > max_frame_num_
+        || sync.vad_history_length != vad_decimator_.history_length()
+        || sync.mfcc_history_length != mfcc_decimator_.history_length()
+        || static_cast<bool>(sync.has_energy) != (frame_energy_ != nullptr)
+        || record.samples.size() != sync.raw_length + history_length + frame_length + energy_length)
+    {
+        return false;
+    }
+
+    const int16_t* data = record.samples.data();
+    std::copy_n(data, sync.raw_length, raw_queue_);
+    raw_length_ = sync.raw_length;
+    data += sync.raw_length;
+    vad_decimator_.restoreHistory(data);
+    mfcc_decimator_.restoreHistory(&data[sync.vad_history_length]);
+    data += history_length;
+    memcpy(raw_mfcc_, data, sync.frame_count * coef_num * sizeof(float));
+    frame_count_ = sync.frame_count;
+    data += frame_length;
+    if (frame_energy_ != nullptr) { memcpy(frame_energy_, data, sync.frame_count * sizeof(float)); }
+
+    // The statistics are rebuilt from the frames they were accumulated from.
+    if (config_.normalization == FeatureNormalization::Incremental)
+    {
+        feature_stats_.rebuild(raw_mfcc_, frame_count_);
+    }
+    return true;
+}
+
+FetchResult MfccCommander::fetchFeature()
+{
+    FetchResult result;
+    FeatureView query;
+    if (fetchQuery(&query, &result))
+    {
+        result.feature = std::unique_ptr<simplevox::MfccFeature>(new simplevox::MfccFeature(query.frame_num, query.coef_num));
+        std::copy_n(query.data, query.frame_num * query.coef_num, &result.feature->feature[0]);
+    }
+    return result;
+}
+
+bool MfccCommander::fetchQuery(FeatureView* query, FetchResult* result)
+{
+    if (!can_fetch()) { return false; }
+
+    const auto start = esp_timer_get_time();
+    const int coef_num = mfcc_engine_.config().coef_num;
+    // A handed-off segment is fetched without stopping the capture of the next one.
+    const bool is_handed_off = config_.continuous_capture;
+    const float* segment = is_handed_off ? ready_mfcc_ : raw_mfcc_;
+    const float* energy = is_handed_off ? ready_energy_ : frame_energy_;
+    auto& feature_stats = is_handed_off ? ready_stats_ : feature_stats_;
+    const int segment_frame_num = is_handed_off ? ready_frame_num_ : frame_count_;
+
+    // The pre-roll and the hangover are cut down to the frames around the voiced part.
+    int begin = 0;
+    int end = segment_frame_num;
+    if (energy != nullptr)
+    {
+        findEndpoints(energy, segment_frame_num, config_.endpoint_trim_db, config_.endpoint_margin, &begin, &end);
+    }
+    result->trim_begin = begin;
+    result->trim_end = segment_frame_num - end;
+    const float* mfcc = &segment[begin * coef_num];
+    const int frame_num = end - begin;
+
+    if (config_.normalization == FeatureNormalization::Incremental)
+    {
+        // The statistics are already accumulated, so only the conversion remains.
+        feature_stats.remove(segment, begin);
+        feature_stats.remove(&segment[end * coef_num], result->trim_end);
+        feature_stats.normalize(mfcc, frame_num, query_feature_);
     }
     else
     {
-        return result;
+        mfcc_engine_.normalize(mfcc, frame_num, coef_num, query_feature_);
+    }
+    *query = FeatureView {
+        .data = query_feature_,
+        .frame_num = frame_num,
+        .coef_num = coef_num
+    };
+    stats_.fetch_us = esp_timer_get_time() - start;
+    if (trace_ != nullptr) { trace_->writeSegment(frame_num, stats_.fetch_us); }
+    if (is_handed_off)
+    {
+        ready_frame_num_ = 0;
+    }
+    else
+    {
+        reset();
     }
+    return true;
 }
 
 bool MfccCommander::detect(const int16_t *data, DetectResult *result)
+{
+    return detectNBest(data, result, 1) > 0;
+}
+
+bool MfccCommander::detect(const simplevox::MfccFeature &feature, DetectResult *result)
+{
+    return detectNBest(feature, result, 1) > 0;
+}
+
+int MfccCommander::detectNBest(const int16_t *data, DetectResult *results, int max_count)
 {
     const auto feed_result = feedSample(data);
     if (feed_result.can_fetch)
     {
-        int index = -1;
-        uint32_t min_dtw = UINT32_MAX;
-        auto fetch_result = fetchFeature();
-        for(int i = 0; i < commands.size(); i++)
+        // The segment is scored in place without a new feature.
+        FetchResult fetch_result;
+        FeatureView query;
+        if (fetchQuery(&query, &fetch_result))
+        {
+            return detectQuery(query, results, max_count);
+        }
+    }
+    return 0;
+}
+
+int MfccCommander::detectNBest(const simplevox::MfccFeature &feature, DetectResult *results, int max_count)
+{
+    return detectQuery(viewOf(feature), results, max_count);
+}
+
+int MfccCommander::detectQuery(const FeatureView &query, DetectResult *results, int max_count)
+{
+    if (max_count <= 0) { return 0; }
+
+    const auto start = esp_timer_get_time();
+    const auto bank = std::atomic_load(&bank_);
+    if (config_.embedding_scoring != EmbeddingScoring::Off)
+    {
+        EmbeddingIndex::embed(query, query_embedding_.data());
+    }
+    if (config_.embedding_scoring == EmbeddingScoring::Standalone)
+    {
+        return detectByEmbedding(*bank, results, max_count, start);
+    }
+
+    // Every working buffer grows only when a longer template or query than ever before comes.
+    FeatureView coarse_query;
+    const bool is_coarse = config_.coarse_factor > 1;
+    if (is_coarse)
+    {
+        const int coarse_length = divCeil(query.frame_num, config_.coarse_factor) * query.coef_num;
+        if (coarse_query_.size() < coarse_length) { coarse_query_.resize(coarse_length); }
+        coarse_query = decimateFeature(query, config_.coarse_factor, coarse_query_.data());
+    }
+
+    const auto& commands = bank->commands;
+    const int capacity = max_count + 1;
+    scratch_.reserve(query.frame_num, bank->max_frame_num, config_.coarse_factor);
+    auto& candidates = candidates_;
+    candidates.clear();
+    candidates.reserve(capacity);
+    // Prefilter scores only the commands nearest by embedding.
+    int match_num = 0;
+    if (config_.embedding_scoring == EmbeddingScoring::Prefilter)
+    {
+        const int candidate_num = std::min(config_.embedding_candidates, bank->embeddings.size());
+        if (matches_.size() < candidate_num) { matches_.resize(candidate_num); }
+        match_num = bank->embeddings.search(query_embedding_.data(), matches_.data(), candidate_num);
+    }
+    const int scored_num = (match_num > 0) ? match_num : bank->active.size();
+    for (int j = 0; j < scored_num; j++)
+    {
+        const int row = (match_num > 0) ? matches_[j].row : j;
+        const int i = bank->active[row];
+        const auto& command = commands[i];
+        const uint32_t worst = (candidates.size() < capacity) ? UINT32_MAX : candidates.back().dtw.score;
+        const uint32_t bound = std::min(worst, command.info.threshold);
+        const auto dtw = score(query, is_coarse ? &coarse_query : nullptr, command, bound);
+        ESP_LOGI(TAG, "command[%d]: %lu", i, dtw.score);
+        if (trace_ != nullptr) { trace_->writeScore(i, dtw.score); }
+        if (dtw.score < worst && dtw.score < command.info.threshold)
+        {
+            auto it = candidates.begin();
+            while (it != candidates.end() && (*it).dtw.score <= dtw.score) { ++it; }
+            if (candidates.size() == capacity) { candidates.pop_back(); }
+            candidates.insert(it, Candidate{ dtw, i });
+        }
+    }
+
+    const int count = std::min<int>(candidates.size(), max_count);
+    for (int i = 0; i < count; i++)
+    {
+        const auto& command = commands[candidates[i].index];
+        auto& result = results[i];
+        result.command_name = command.info.name;
+        result.id = command.info.id;
+        result.score = candidates[i].dtw.score;
+        result.normalized_score = candidates[i].dtw.normalized_score;
+        result.margin = (i + 1 < candidates.size())
+            ? candidates[i + 1].dtw.score - candidates[i].dtw.score
+            : UINT32_MAX;
+    }
+
+    stats_.score_us = esp_timer_get_time() - start;
+    if (trace_ != nullptr)
+    {
+        trace_->writeDetect((count > 0) ? candidates[0].index : -1, (count > 0) ? candidates[0].dtw.score : UINT32_MAX, stats_.score_us);
+    }
+    return count;
+}
+
+int MfccCommander::detectByEmbedding(const CommandBank &bank, DetectResult *results, int max_count, int64_t start)
+{
+    // One more match than requested is kept for the margin of the last result.
+    if (matches_.size() < max_count + 1) { matches_.resize(max_count + 1); }
+    const auto& matches = matches_;
+    const int match_num = bank.embeddings.search(query_embedding_.data(), matches_.data(), max_count + 1);
+    int count = 0;
+    while (count < std::min(match_num, max_count) && matches[count].distance < config_.embedding_threshold)
+    {
+        const auto& command = bank.commands[bank.active[matches[count].row]];
+        auto& result = results[count];
+        result.command_name = command.info.name;
+        result.id = command.info.id;
+        result.score = matches[count].distance;
+        result.normalized_score = matches[count].distance;
+        result.margin = (count + 1 < match_num)
+            ? matches[count + 1].distance - matches[count].distance
+            : UINT32_MAX;
+        count++;
+    }
+
+    stats_.score_us = esp_timer_get_time() - start;
+    if (trace_ != nullptr)
+    {
+        trace_->writeDetect((count > 0) ? bank.active[matches[0].row] : -1, (count > 0) ? matches[0].distance : UINT32_MAX, stats_.score_us);
+    }
+    return count;
+}
+
+bool MfccCommander::spot(const int16_t *data, SpotResult *result)
+{
+    if (spot_feature_ == nullptr) { return false; }
+
+    const int mfcc_frame_length = config_.mfcc_config.frame_length();
+    const int mfcc_hop_length = config_.mfcc_config.hop_length();
+    const int mfcc_coef_num = config_.mfcc_config.coef_num;
+
+    // Spotting restarts when a new bank version is published.
+    const auto bank = std::atomic_load(&bank_);
+    if (bank != spot_bank_)
+    {
+        spot_bank_ = bank;
+        spotters_.resize(bank->commands.size());
+        for (int i = 0; i < spotters_.size(); i++)
+        {
+            spotters_[i].init(frameNumOf(*bank->commands[i].data));
+        }
+    }
+
+    bool is_spotted = false;
+    arr_push_back(decimate(&mfcc_decimator_, data, frame_length_, mfcc_frame_), mfcc_feed_length_, raw_queue_, &raw_length_);
+    while (raw_length_ >= mfcc_frame_length)
+    {
+        // raw_mfcc_ is a ring of the latest max_frame_num_ frames, and the newest replaces the oldest.
+        const int slot = spot_frame_index_ % max_frame_num_;
+        float* mfcc = &raw_mfcc_[slot * mfcc_coef_num];
+        if (frame_count_ >= max_frame_num_)
+        {
+            feature_stats_.remove(mfcc, 1);
+        }
+        else
+        {
+            frame_count_++;
+        }
+        mfcc_engine_.calculate(raw_queue_, mfcc);
+        arr_pop_front(raw_queue_, mfcc_hop_length, &raw_length_);
+        if (slot == 0)
+        {
+            // The sums slide forever, so they are recalculated once per round of the ring.
+            feature_stats_.rebuild(raw_mfcc_, frame_count_);
+        }
+        else
+        {
+            feature_stats_.add(mfcc);
+        }
+
+        // Only the newest frame is normalized, by the running statistics of the window.
+        feature_stats_.normalize(mfcc, 1, spot_feature_);
+        const FeatureView frame {
+            .data = spot_feature_,
+            .frame_num = 1,
+            .coef_num = mfcc_coef_num
+        };
+        for (const int i: bank->active)
         {
-            const auto& command = commands[i];
-            const auto dtw = simplevox::calcDTW(*fetch_result.feature, *command.feature);
-            ESP_LOGI(TAG, "command[%d]: %lu", i, dtw);
-            if (dtw < min_dtw && dtw < command.info.threshold)
+            const auto& entry = bank->commands[i];
+            const auto& template_data = *entry.data;
+            SpotMatch match;
+            const bool is_matched = template_data.quantized_feature
+                ? spotters_[i].update(frame, spot_frame_index_, viewOf(*template_data.quantized_feature), entry.info.threshold, &match)
+                : spotters_[i].update(frame, spot_frame_index_, viewOf(*template_data.feature), entry.info.threshold, &match);
+            if (is_matched && (!is_spotted || match.score < result->score))
             {
-                min_dtw = dtw;
-                index = i;
+                ESP_LOGI(TAG, "spot %s: %lu [%d, %d]", entry.info.name.c_str(), match.score, match.start_frame, match.end_frame);
+                result->command_name = entry.info.name;
+                result->id = entry.info.id;
+                result->score = match.score;
+                result->start_frame = match.start_frame;
+                result->end_frame = match.end_frame;
+                is_spotted = true;
             }
         }
+        spot_frame_index_++;
+    }
+    return is_spotted;
+}
+
+template<class F>
+void MfccCommander::modifyBank(F modify)
+{
+    std::lock_guard<std::mutex> lock(bank_mutex_);
+    auto bank = std::make_shared<CommandBank>(*std::atomic_load(&bank_));
+    modify(bank.get());
+    indexBank(bank.get());
 
-        const bool is_detected = (index >= 0);
-        if (is_detected)
+    retired_banks_.push_back(std::atomic_exchange(&bank_, std::shared_ptr<const CommandBank>(std::move(bank))));
+
+    // Versions no scorer holds any more are freed here, not on the audio path.
+    retired_banks_.erase(
+        std::remove_if(retired_banks_.begin(), retired_banks_.end(), [](const std::shared_ptr<const CommandBank>& retired) {
+            return retired.use_count() == 1;
+        }),
+        retired_banks_.end());
+}
+
+void MfccCommander::addTo(CommandBank *bank, MfccCommand &&command)
+{
+    auto data = prepare(std::move(command.feature), std::move(command.quantized_feature));
+    if (!data)
+    {
+        ESP_LOGE(TAG, "No feature: %s", command.info.name.c_str());
+        return;
+    }
+
+    for (auto& cmd: bank->commands)
+    {
+        if (cmd.info.id == command.info.id
+            && cmd.info.name.compare(command.info.name) == 0)
         {
-            const auto& command = commands[index];
-            result->command_name = command.info.name;
-            result->id = command.info.id;
-            result->score = min_dtw;
+            ESP_LOGI(TAG, "Swap and Add command: %s", command.info.name.c_str());
+            cmd.info = std::move(command.info);
+            cmd.data = std::move(data);
+            return;
         }
-        return is_detected;
     }
-    return false;
+
+    ESP_LOGI(TAG, "Add command: %s", command.info.name.c_str());
+    bank->commands.push_back(CommandEntry {
+        .info = std::move(command.info),
+        .data = std::move(data)
+    });
+}
+
+void MfccCommander::indexBank(CommandBank *bank)
+{
+    // The active subset is fixed per version, so scoring never filters the commands.
+    bank->active.clear();
+    bank->embeddings.clear();
+    bank->max_frame_num = 0;
+    for (int i = 0; i < bank->commands.size(); i++)
+    {
+        bank->max_frame_num = std::max(bank->max_frame_num, frameNumOf(*bank->commands[i].data));
+
+        const auto& contexts = bank->commands[i].info.contexts;
+        const bool is_active = contexts.empty() || bank->active_contexts.empty()
+            || std::any_of(contexts.begin(), contexts.end(), [&](const std::string& context) {
+                return std::find(bank->active_contexts.begin(), bank->active_contexts.end(), context) != bank->active_contexts.end();
+            });
+        if (is_active)
+        {
+            bank->active.push_back(i);
+            const auto& data = *bank->commands[i].data;
+            if (!data.embedding.empty()) { bank->embeddings.add(data.embedding); }
+        }
+    }
+}
+
+void MfccCommander::removeFrom(CommandBank *bank, const std::string &name, int id)
+{
+    auto& commands = bank->commands;
+    commands.erase(
+        std::remove_if(commands.begin(), commands.end(), [&](const CommandEntry& entry) {
+            return entry.info.name == name && (id < 0 || id == entry.info.id);
+        }),
+        commands.end());
+}
+
+void MfccCommander::modifyIn(CommandBank *bank, const std::string &name, int id, const CommandInfo &info)
+{
+    for (auto& command: bank->commands)
+    {
+        if (command.info.name == name && command.info.id == id)
+        {
+            command.info = info;
+            break;
+        }
+    }
+}
+
+int MfccCommander::frameNumOf(const CommandTemplate &data)
+{
+    return data.quantized_feature ? data.quantized_feature->frame_num : viewOf(*data.feature).frame_num;
+}
+
+std::shared_ptr<const MfccCommander::CommandTemplate> MfccCommander::prepare(std::unique_ptr<simplevox::MfccFeature> feature, std::unique_ptr<QuantizedFeature> quantized_feature)
+{
+    auto data = std::make_shared<CommandTemplate>();
+    data->feature = std::move(feature);
+    data->quantized_feature = std::move(quantized_feature);
+    if (!data->feature && data->quantized_feature)
+    {
+        data->feature = std::unique_ptr<simplevox::MfccFeature>(dequantizeFeature(*data->quantized_feature));
+    }
+    if (!data->feature)
+    {
+        return nullptr;
+    }
+
+    if (config_.coarse_factor > 1)
+    {
+        data->coarse_feature = std::unique_ptr<simplevox::MfccFeature>(decimateFeature(*data->feature, config_.coarse_factor));
+    }
+    if (config_.embedding_scoring != EmbeddingScoring::Off)
+    {
+        const auto view = viewOf(*data->feature);
+        data->embedding.resize(EmbeddingIndex::lengthOf(view.coef_num));
+        EmbeddingIndex::embed(view, data->embedding.data());
+    }
+
+    // Only one representation is kept so that the int8 bank takes half the memory.
+    if (config_.template_format == TemplateFormat::Int8)
+    {
+        if (!data->quantized_feature)
+        {
+            data->quantized_feature = std::unique_ptr<QuantizedFeature>(quantizeFeature(*data->feature));
+        }
+        data->feature.reset();
+    }
+    else
+    {
+        data->quantized_feature.reset();
+    }
+    return data;
+}
+
+DtwScore MfccCommander::score(const FeatureView &query, const FeatureView *coarse_query, const CommandEntry &entry, uint32_t bound)
+{
+    const auto& data = *entry.data;
+
+    if (coarse_query == nullptr || !data.coarse_feature)
+    {
+        return data.quantized_feature
+            ? kernels_->full_q8(query, viewOf(*data.quantized_feature), bound, &scratch_)
+            : kernels_->full(query, viewOf(*data.feature), bound, &scratch_);
+    }
+
+    // Commands whose coarse score is far over the threshold are rejected without the fine pass.
+    const auto coarse_dtw = kernels_->coarse(*coarse_query, viewOf(*data.coarse_feature), &scratch_);
+    if (static_cast<uint64_t>(coarse_dtw) * 100 >= static_cast<uint64_t>(entry.info.threshold) * config_.coarse_margin)
+    {
+        return kNoScore;
+    }
+    return data.quantized_feature
+        ? kernels_->corridor_q8(query, viewOf(*data.quantized_feature), scratch_.path, config_.coarse_factor, config_.coarse_radius, bound, &scratch_)
+        : kernels_->corridor(query, viewOf(*data.feature), scratch_.path, config_.coarse_factor, config_.coarse_radius, bound, &scratch_);
 }
 
 } // namespace cmdvox
@@ -8,22 +8,97 @@
  */
 
 #ifndef CMDVOX_H_
-#define CMDVOC_H_
+#define CMDVOX_H_
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <simplevox.h>
 
+#include "decimator.h"
+#include "dtw.h"
+#include "embedding.h"
+#include "feature_stats.h"
+#include "quantized_feature.h"
+
 namespace cmdvox
 {
 
+class TraceWriter;
+struct TraceRecord;
+struct ReplayReport;
+struct DtwKernels;
+
+enum class TemplateFormat
+{
+    Int16,
+    Int8,   // 8-bit quantized with per-coefficient offset/shift
+};
+
+enum class FeatureNormalization
+{
+    Engine,         // simplevox::MfccEngine::create after end of speech
+    Incremental,    // CMVN x FeatureStats::kScale from running statistics updated in feedSample (not compatible with Engine templates)
+};
+
+enum class EmbeddingScoring
+{
+    Off,        // DTW against every active command
+    Prefilter,  // DTW against the nearest commands by embedding only
+    Standalone, // embedding distance as the score (no DTW)
+};
+
 struct CommanderConfig
 {
     simplevox::VadConfig vad_config;
     simplevox::MfccConfig mfcc_config;
     int limit_time_ms = 3000;
+
+    // sample rate of the feedSample/spot input (0: mfcc_config.sample_rate)
+    // A multiple of both stage rates; the input is decimated to each of them internally.
+    int capture_rate = 0;
+
+    // coarse-to-fine scoring (coarse_factor <= 1: exact scoring only)
+    int coarse_factor = 1;      // frame decimation factor of the coarse pass
+    int coarse_radius = 2;      // corridor half width of the fine pass in frames
+    int coarse_margin = 120;    // coarse score limit in percent of the threshold
+
+    // fixed-size embedding scoring (EmbeddingIndex)
+    EmbeddingScoring embedding_scoring = EmbeddingScoring::Off;
+    int embedding_candidates = 3;                   // commands forwarded to DTW by Prefilter
+    uint32_t embedding_threshold = UINT32_MAX;      // distance limit of Standalone (instead of CommandInfo::threshold)
+
+    // energy-based endpoint refinement of fetched features (0: disabled)
+    int endpoint_trim_db = 0;   // frames weaker than the peak frame by more than this are trimmed from both ends
+    int endpoint_margin = 2;    // frames kept outside the refined endpoints
+
+    // keep raw pre-roll samples while idle and calculate their MFCCs on speech onset
+    bool lazy_feature = false;
+
+    // storage format of the registered features
+    TemplateFormat template_format = TemplateFormat::Int16;
+
+    // continuous keyword spotting by MfccCommander::spot (subsequence DTW without VAD)
+    // Each frame is normalized by the running statistics of the last limit_time_ms as with Incremental normalization,
+    // so the templates must be created with FeatureNormalization::Incremental.
+    bool spotting = false;
+
+    // normalization of fetched features (templates must be created with the same one)
+    FeatureNormalization normalization = FeatureNormalization::Engine;
+
+    // hand off each completed segment and keep listening without reset (no audio is dropped between segments)
+    // The segment must be fetched before the next one completes, otherwise it is replaced.
+    bool continuous_capture = false;
+
+    // low-power listening: VAD and MFCC are skipped while a cheap energy/zero-crossing gate is closed
+    int gate_level = 0;         // mean absolute amplitude that opens the gate (0: disabled)
+    int gate_zero_cross = 250;  // zero crossings per 1000 samples (VAD rate) that open the gate at half the level
+    int gate_hold_ms = 2000;    // silence after which the gate closes again
 };
 
 /**
@@ -37,12 +112,37 @@ struct CommandInfo
     int id;
     uint32_t threshold;
     std::string path;
+    std::vector<std::string> contexts;  // empty: active in every context
+    int trim_begin = 0;                 // frames trimmed from the head of the fetched segment at enrollment
+    int trim_end = 0;                   // frames trimmed from the tail
 };
 
+/**
+ * @brief command to register
+ * @note Either feature or quantized_feature is required.
+ * 
+ */
 struct MfccCommand
 {
     CommandInfo info;
     std::unique_ptr<simplevox::MfccFeature> feature;
+    std::unique_ptr<QuantizedFeature> quantized_feature;
+};
+
+/**
+ * @brief state and stage timings of the latest feedSample/detect
+ */
+struct FrameStats
+{
+    simplevox::VadState vad_state;
+    bool gate_open;
+    int frame_count;
+    int raw_length;
+    bool can_fetch;
+    uint32_t vad_us;
+    uint32_t mfcc_us;
+    uint32_t fetch_us;
+    uint32_t score_us;
 };
 
 struct FeedResult
@@ -53,6 +153,8 @@ struct FeedResult
 struct FetchResult
 {
     std::unique_ptr<simplevox::MfccFeature> feature;
+    int trim_begin = 0;     // frames removed by the endpoint refinement
+    int trim_end = 0;
 };
 
 struct DetectResult
@@ -60,11 +162,36 @@ struct DetectResult
     std::string command_name;
     int id;
     uint32_t score;
+    uint32_t normalized_score;  // score normalized by the warping path length
+    uint32_t margin;            // score difference to the next candidate (UINT32_MAX: no other candidate)
+};
+
+struct SpotResult
+{
+    std::string command_name;
+    int id;
+    uint32_t score;
+    int start_frame;    // MFCC frame index in the stream since reset()
+    int end_frame;
+};
+
+/**
+ * @brief externally owned work buffers of the commander
+ */
+struct CommanderBuffers
+{
+    int16_t* raw_queue;
+    int raw_queue_length;   // samples
+    float* raw_mfcc;
+    int raw_mfcc_length;    // frames x coefficients
+    int16_t* query_feature; // raw_mfcc_length values
 };
 
 class MfccCommander
 {
 public:
+    ~MfccCommander();
+
     bool init(const CommanderConfig& config);
     void deinit();
     void reset();
@@ -74,15 +201,55 @@ public:
     void modifyInfo(const std::string& name, int id, const CommandInfo& info);
     void clear();
 
+    /**
+     * @brief Limits detection and spotting to the commands of the contexts.
+     * @note Commands without contexts are always active. An empty list activates every command.
+     */
+    void activateContexts(const std::vector<std::string>& contexts);
+
     void saveSettings(const std::string& path);
+    /**
+     * @brief Adds the commands in the settings file and replays its journal if any.
+     */
     void loadSettings(const std::string& path);
 
+    /**
+     * @brief Starts appending add/remove/modifyInfo/clear to the journal of the settings file.
+     * @note Call loadSettings(path) first. The settings file is rewritten at open and
+     *       in the background once the journal exceeds limit bytes, then the journal is truncated.
+     */
+    bool openJournal(const std::string& path, long limit = 4096);
+    void closeJournal();
+
     FeedResult feedSample(const int16_t* data);
     FetchResult fetchFeature();
     bool detect(const int16_t* data, DetectResult* result);
+    bool detect(const simplevox::MfccFeature& feature, DetectResult* result);
+    /**
+     * @brief Detects up to max_count commands under their thresholds in ascending order of score.
+     * @note The segment of the int16_t* overloads is scored in place. Once the working storage has grown,
+     *       it does not allocate as long as results are reused (command_name keeps its capacity).
+     * @return number of the detected commands
+     */
+    int detectNBest(const int16_t* data, DetectResult* results, int max_count);
+    int detectNBest(const simplevox::MfccFeature& feature, DetectResult* results, int max_count);
+    /**
+     * @brief Spots commands in a continuous stream without VAD segmentation.
+     * @note Requires CommanderConfig::spotting. Do not mix with feedSample/detect before reset().
+     * @return true if a command ended in this sample
+     */
+    bool spot(const int16_t* data, SpotResult* result);
 
     int feed_length() { return frame_length_; }
     simplevox::VadState vad_state() { return vad_state_; }
+    const FrameStats& frame_stats() { return stats_; }
+    const CommanderConfig& config() { return config_; }
+
+    /**
+     * @brief Records input frames, states and detection events of feedSample/detect.
+     * @param[in] trace nullptr to stop recording
+     */
+    void setTrace(TraceWriter* trace) { trace_ = trace; }
 
     // delegation
     int detectVoice(int16_t* dest, int length, const int16_t* data) { return vad_engine_.detect(dest, length, data); }
@@ -90,24 +257,167 @@ public:
     void normFeature(const float* src, int frame_num, int coef_num, int16_t* dest) { mfcc_engine_.normalize(src, frame_num, coef_num, dest); }
     static bool saveFeature(const char* path, const simplevox::MfccFeature& mfcc) { return simplevox::MfccEngine::saveFile(path, mfcc); }
     static simplevox::MfccFeature* loadFeature(const char* path) { return simplevox::MfccEngine::loadFile(path); }
+    static bool saveQuantizedFeature(const char* path, const QuantizedFeature& feature) { return saveQuantizedFile(path, feature); }
+    static QuantizedFeature* loadQuantizedFeature(const char* path) { return loadQuantizedFile(path); }
     simplevox::MfccFeature* createFeature(const int16_t* raw_audio, int length) { return mfcc_engine_.create(raw_audio, length); }
     simplevox::MfccFeature* createFeature(const float* mfccs, int frame_num, int coef_num) { return mfcc_engine_.create(mfccs, frame_num, coef_num); }
+protected:
+    /**
+     * @brief Initializes with the buffers and the DTW kernels given by a specialized commander.
+     * @param[in] buffers   nullptr to allocate the buffers on the heap
+     * @return false if the buffers are smaller than the config requires
+     */
+    bool init(const CommanderConfig& config, const CommanderBuffers* buffers, const DtwKernels& kernels);
+
 private:
+    struct CommandTemplate
+    {
+        std::unique_ptr<simplevox::MfccFeature> feature;
+        std::unique_ptr<QuantizedFeature> quantized_feature;
+        std::unique_ptr<simplevox::MfccFeature> coarse_feature;
+        std::vector<float> embedding;
+    };
+
+    struct CommandEntry
+    {
+        CommandInfo info;
+        std::shared_ptr<const CommandTemplate> data;
+    };
+
+    // One more candidate than requested is kept for the margin of the last result.
+    struct Candidate
+    {
+        DtwScore dtw;
+        int index;
+    };
+
+    enum class JournalOp
+    {
+        Add,
+        Remove,
+        Modify,
+        Clear,
+    };
+
+    /**
+     * @brief operation read from the settings file or the journal
+     * @note name and id identify the target of Remove and Modify (command.info is the new info).
+     */
+    struct JournalRecord
+    {
+        JournalOp op;
+        std::string name;
+        int id;
+        MfccCommand command;
+    };
+
+    /**
+     * @brief immutable version of the registered commands
+     * @note A new version is built by copy-on-write off the audio path and published by swapping the pointer.
+     *       std::atomic_load/atomic_exchange on shared_ptr are not lock-free (libstdc++ guards them with a mutex pool),
+     *       but their critical section is a bounded pointer swap, so readers never wait for a writer's copy and indexing.
+     */
+    struct CommandBank
+    {
+        std::vector<CommandEntry> commands;
+        std::vector<std::string> active_contexts;
+        std::vector<int> active;    // indices of the commands in the active contexts
+        int max_frame_num = 0;      // frames of the longest template
+        EmbeddingIndex embeddings;  // rows follow active
+    };
+
     CommanderConfig config_;
     simplevox::VadEngine vad_engine_;
     simplevox::MfccEngine mfcc_engine_;
-    std::vector<MfccCommand> commands;
-    int frame_length_;
+    std::shared_ptr<const CommandBank> bank_ = std::make_shared<const CommandBank>();
+    std::vector<std::shared_ptr<const CommandBank>> retired_banks_;
+    std::mutex bank_mutex_;
+    int frame_length_;          // input samples per feedSample at the capture rate
+    int mfcc_feed_length_;      // samples per feedSample at the MFCC rate
+    Decimator vad_decimator_;
+    Decimator mfcc_decimator_;
+    int16_t* vad_frame_ = nullptr;
+    int16_t* mfcc_frame_ = nullptr;
 
+    const DtwKernels* kernels_ = nullptr;
+    bool owns_buffers_ = true;
     int16_t* raw_queue_ = nullptr;
     int raw_max_length_;
     int raw_length_;
     float* raw_mfcc_ = nullptr;
+    float* ready_mfcc_ = nullptr;       // completed segment waiting for fetchFeature (continuous_capture)
+    float* segment_buffer_ = nullptr;   // heap buffer swapped with raw_mfcc_
+    float* frame_energy_ = nullptr;     // log energy of each frame in raw_mfcc_ (endpoint_trim_db)
+    float* ready_energy_ = nullptr;
+    float* energy_buffer_ = nullptr;
+    int ready_frame_num_;
+    bool is_skipping_;                  // the rest of a segment cut by the length limit is being discarded
+    bool is_vad_restarted_;             // the VAD was restarted in the current frame (trace sync point)
     int max_frame_num_;
     int pre_frame_num_;
     int frame_count_;
     simplevox::VadState vad_state_;
-    bool can_fetch() { return vad_state_ == simplevox::VadState::Detected || (vad_state_ >= simplevox::VadState::Speech && max_frame_num_ <= frame_count_); }
+    int16_t* gate_queue_ = nullptr;
+    int gate_frame_num_;
+    int gate_head_;
+    int gate_count_;
+    int gate_hold_count_;
+    int gate_silence_count_;
+    bool gate_open_;
+    int16_t* query_feature_ = nullptr;  // normalized segment scored by detect
+    int16_t* spot_feature_ = nullptr;
+    int spot_frame_index_;
+    std::shared_ptr<const CommandBank> spot_bank_;
+    std::vector<SubsequenceDTW> spotters_;
+    FeatureStats feature_stats_;
+    FeatureStats ready_stats_;
+    DtwScratch scratch_;
+    std::vector<float> query_embedding_;
+    std::vector<int16_t> coarse_query_;
+    std::vector<Candidate> candidates_;
+    std::vector<EmbeddingMatch> matches_;
+    FrameStats stats_ = {};
+    TraceWriter* trace_ = nullptr;
+    FILE* journal_ = nullptr;
+    std::string journal_path_;
+    long journal_limit_;
+    uint32_t journal_generation_ = 0;
+    std::thread compaction_;
+    std::atomic<bool> is_compacting_ { false };
+    void feed(const int16_t* data);
+    void process(const int16_t* data);
+    void handOff(simplevox::VadState state);
+    void dropFrames(int count);
+    void writeSync();
+    bool restoreSync(const TraceRecord& record);
+    friend bool replayTrace(const char* path, MfccCommander* commander, ReplayReport* report);
+    bool isGateTripped(const int16_t* data);
+    void freeBuffers();
+    bool initDecimators(const CommanderConfig& config, int capture_rate);
+    void freeDecimators();
+    template<class F>
+    void modifyBank(F modify);
+    void addTo(CommandBank* bank, MfccCommand&& command);
+    static void indexBank(CommandBank* bank);
+    static int frameNumOf(const CommandTemplate& data);
+    static void removeFrom(CommandBank* bank, const std::string& name, int id);
+    static void modifyIn(CommandBank* bank, const std::string& name, int id, const CommandInfo& info);
+    void appendJournal(JournalOp op, const std::string& name, int id, const CommandInfo* info);
+    void compact();
+    bool writeSnapshot();
+    void writeSettings(FILE* file, const CommandBank& bank, uint32_t generation);
+    bool readSettings(const std::string& path, std::vector<JournalRecord>* records, uint32_t* generation);
+    bool readJournal(const std::string& path, std::vector<JournalRecord>* records, uint32_t* generation);
+    std::shared_ptr<const CommandTemplate> prepare(std::unique_ptr<simplevox::MfccFeature> feature, std::unique_ptr<QuantizedFeature> quantized_feature);
+    bool fetchQuery(FeatureView* query, FetchResult* result);
+    int detectQuery(const FeatureView& query, DetectResult* results, int max_count);
+    int detectByEmbedding(const CommandBank& bank, DetectResult* results, int max_count, int64_t start);
+    DtwScore score(const FeatureView& query, const FeatureView* coarse_query, const CommandEntry& entry, uint32_t bound);
+    bool can_fetch()
+    {
+        if (config_.continuous_capture) { return ready_frame_num_ > 0; }
+        return vad_state_ == simplevox::VadState::Detected || (vad_state_ >= simplevox::VadState::Speech && max_frame_num_ <= frame_count_);
+    }
 };
 
 } // namespace cmdvox
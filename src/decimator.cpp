@@ -0,0 +1,127 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include "decimator.h"
+
+#include <algorithm>
+#include <vector>
+#include <math.h>
+
+#include <esp_heap_caps.h>
+
+namespace
+{
+
+constexpr double kPi = 3.14159265358979;
+constexpr double kCutoff = 0.40;    // cut-off frequency of the low-pass filter in the output rate (over 70 dB down from 0.5)
+
+/**
+ * @brief 値をint16_tの範囲に丸めます
+ */
+int16_t saturate(int32_t value)
+{
+    return static_cast<int16_t>(std::min<int32_t>(std::max<int32_t>(value, INT16_MIN), INT16_MAX));
+}
+
+}
+
+
+namespace cmdvox
+{
+
+bool Decimator::init(int factor, int max_length)
+{
+    deinit();
+    if (factor < 1 || max_length % factor != 0) { return false; }
+
+    factor_ = factor;
+    max_length_ = max_length;
+    tap_num_ = kTapsPerPhase * factor;
+    coefs_ = (int16_t*)heap_caps_malloc(sizeof(*coefs_) * tap_num_, MALLOC_CAP_8BIT);
+    history_ = (int16_t*)heap_caps_malloc(sizeof(*history_) * (tap_num_ - 1 + max_length), MALLOC_CAP_8BIT);
+    if (coefs_ == nullptr || history_ == nullptr)
+    {
+        deinit();
+        return false;
+    }
+
+    // Windowed-sinc low-pass filter (Blackman window) with unity DC gain
+    const double cutoff = kCutoff / factor;
+    const double center = (tap_num_ - 1) / 2.0;
+    double sum = 0.0;
+    std::vector<double> taps(tap_num_);
+    for (int k = 0; k < tap_num_; k++)
+    {
+        const double t = k - center;
+        const double sinc = (t == 0.0) ? 2.0 * cutoff : sin(2.0 * kPi * cutoff * t) / (kPi * t);
+        const double window = 0.42 - 0.5 * cos(2.0 * kPi * k / (tap_num_ - 1)) + 0.08 * cos(4.0 * kPi * k / (tap_num_ - 1));
+        taps[k] = sinc * window;
+        sum += taps[k];
+    }
+    for (int k = 0; k < tap_num_; k++)
+    {
+        coefs_[tap_num_ - 1 - k] = static_cast<int16_t>(lround(taps[k] / sum * 32767.0));
+    }
+
+    reset();
+    return true;
+}
+
+void Decimator::deinit()
+{
+    if (coefs_ != nullptr)
+    {
+        heap_caps_free(coefs_);
+        coefs_ = nullptr;
+    }
+    if (history_ != nullptr)
+    {
+        heap_caps_free(history_);
+        history_ = nullptr;
+    }
+    factor_ = 1;
+}
+
+void Decimator::reset()
+{
+    if (history_ != nullptr) { std::fill_n(history_, tap_num_ - 1, 0); }
+}
+
+void Decimator::restoreHistory(const int16_t* history)
+{
+    if (history_ != nullptr) { std::copy_n(history, tap_num_ - 1, history_); }
+}
+
+int Decimator::process(const int16_t* src, int length, int16_t* dest)
+{
+    if (factor_ == 1)
+    {
+        std::copy_n(src, length, dest);
+        return length;
+    }
+
+    const int history_length = tap_num_ - 1;
+    std::copy_n(src, length, &history_[history_length]);
+    const int out_length = length / factor_;
+    for (int n = 0; n < out_length; n++)
+    {
+        // The output at the last input of each phase group
+        const int16_t* x = &history_[(n + 1) * factor_ - 1];
+        int32_t acc = 0;
+        for (int k = 0; k < tap_num_; k++)
+        {
+            acc += coefs_[k] * x[k];
+        }
+        dest[n] = saturate((acc + (1 << 14)) >> 15);
+    }
+    std::copy(&history_[length], &history_[length + history_length], history_);
+    return out_length;
+}
+
+} // namespace cmdvox
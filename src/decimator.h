@@ -0,0 +1,63 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_DECIMATOR_H_
+#define CMDVOX_DECIMATOR_H_
+
+#include <stdint.h>
+
+namespace cmdvox
+{
+
+/**
+ * @brief polyphase FIR decimator by an integer factor
+ * @note Only every factor-th output of the anti-aliasing low-pass filter is calculated.
+ *       Each output takes kTapsPerPhase x factor multiply-adds, that is kTapsPerPhase per input sample.
+ *       The filter history is carried over between process calls.
+ */
+class Decimator
+{
+public:
+    /**
+     * @param[in] factor        input rate / output rate
+     * @param[in] max_length    maximum input samples of a process call (multiple of factor)
+     */
+    bool init(int factor, int max_length);
+    void deinit();
+    void reset();
+
+    /**
+     * @param[in] src       length samples (multiple of factor)
+     * @param[out] dest     length / factor samples
+     * @return output samples
+     */
+    int process(const int16_t* src, int length, int16_t* dest);
+
+    int factor() const { return factor_; }
+
+    /**
+     * @brief filter history carried over to the next process call (for tracing)
+     */
+    int history_length() const { return (history_ != nullptr) ? tap_num_ - 1 : 0; }
+    const int16_t* history() const { return history_; }
+    void restoreHistory(const int16_t* history);
+
+    static constexpr int kTapsPerPhase = 32;
+
+private:
+    int factor_ = 1;
+    int tap_num_ = 0;
+    int max_length_ = 0;
+    int16_t* coefs_ = nullptr;      // Q15, reversed for the dot product with the history
+    int16_t* history_ = nullptr;    // tap_num_ - 1 previous samples followed by the input
+};
+
+} // namespace cmdvox
+
+#endif // CMDVOX_DECIMATOR_H_
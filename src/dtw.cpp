@@ -0,0 +1,221 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include "dtw.h"
+#include "dtw_kernel.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
+namespace
+{
+
+using cmdvox::kernel::kInfinity;
+
+}
+
+
+namespace cmdvox
+{
+
+FeatureView viewOf(const simplevox::MfccFeature& feature)
+{
+    return FeatureView {
+        .data = &feature.feature[0],
+        .frame_num = feature.frame_num,
+        .coef_num = feature.coef_num
+    };
+}
+
+simplevox::MfccFeature* decimateFeature(const simplevox::MfccFeature& feature, int factor)
+{
+    const auto src = viewOf(feature);
+    auto dest = new simplevox::MfccFeature((src.frame_num + factor - 1) / factor, src.coef_num);
+    decimateFeature(src, factor, &dest->feature[0]);
+    return dest;
+}
+
+FeatureView decimateFeature(const FeatureView& feature, int factor, int16_t* dest)
+{
+    const int frame_num = (feature.frame_num + factor - 1) / factor;
+    for (int i = 0; i < frame_num; i++)
+    {
+        const int begin = i * factor;
+        const int end = std::min(begin + factor, feature.frame_num);
+        for (int k = 0; k < feature.coef_num; k++)
+        {
+            int32_t sum = 0;
+            for (int f = begin; f < end; f++)
+            {
+                sum += feature.frame(f)[k];
+            }
+            dest[i * feature.coef_num + k] = sum / (end - begin);
+        }
+    }
+    return FeatureView {
+        .data = dest,
+        .frame_num = frame_num,
+        .coef_num = feature.coef_num
+    };
+}
+
+void DtwScratch::reserve(int x_frame_num, int y_frame_num, int coarse_factor)
+{
+    const int row_length = std::min(x_frame_num, y_frame_num);
+    for (int k = 0; k < 2; k++)
+    {
+        if (cost[k].size() < row_length) { cost[k].resize(row_length); }
+        if (length[k].size() < row_length) { length[k].resize(row_length); }
+    }
+
+    if (coarse_factor > 1)
+    {
+        const int coarse_x = (x_frame_num + coarse_factor - 1) / coarse_factor;
+        const int coarse_y = (y_frame_num + coarse_factor - 1) / coarse_factor;
+        if (steps.size() < coarse_x * coarse_y) { steps.resize(coarse_x * coarse_y); }
+        path.x.reserve(coarse_x + coarse_y);
+        path.y.reserve(coarse_x + coarse_y);
+    }
+}
+
+DtwScore calcDTW(const FeatureView& x, const FeatureView& y, uint32_t bound)
+{
+    DtwScratch scratch;
+    scratch.reserve(x.frame_num, y.frame_num);
+    return kernel::fullDTW<0>(x, y, bound, &scratch);
+}
+
+DtwScore calcDTW(const FeatureView& x, const QuantizedView& y, uint32_t bound)
+{
+    DtwScratch scratch;
+    scratch.reserve(x.frame_num, y.frame_num);
+    return kernel::fullDTW<0>(x, y, bound, &scratch);
+}
+
+uint32_t calcCoarseDTW(const FeatureView& x, const FeatureView& y, WarpingPath* path)
+{
+    DtwScratch scratch;
+    scratch.cost[0].resize(std::min(x.frame_num, y.frame_num));
+    scratch.cost[1].resize(std::min(x.frame_num, y.frame_num));
+    scratch.steps.resize(x.frame_num * y.frame_num);
+    const uint32_t score = kernel::coarseDTW<0>(x, y, &scratch);
+    if (path != nullptr) { *path = std::move(scratch.path); }
+    return score;
+}
+
+DtwScore calcCorridorDTW(const FeatureView& x, const FeatureView& y, const WarpingPath& path, int factor, int radius, uint32_t bound)
+{
+    DtwScratch scratch;
+    scratch.reserve(x.frame_num, y.frame_num);
+    return kernel::corridorDTW<0>(x, y, path, factor, radius, bound, &scratch);
+}
+
+DtwScore calcCorridorDTW(const FeatureView& x, const QuantizedView& y, const WarpingPath& path, int factor, int radius, uint32_t bound)
+{
+    DtwScratch scratch;
+    scratch.reserve(x.frame_num, y.frame_num);
+    return kernel::corridorDTW<0>(x, y, path, factor, radius, bound, &scratch);
+}
+
+void SubsequenceDTW::init(int frame_num)
+{
+    cost_.assign(frame_num, kInfinity);
+    start_.assign(frame_num, 0);
+    reset();
+}
+
+void SubsequenceDTW::reset()
+{
+    std::fill(cost_.begin(), cost_.end(), kInfinity);
+    candidate_.score = UINT32_MAX;
+    candidate_cost_ = kInfinity;
+}
+
+bool SubsequenceDTW::update(const FeatureView& frame, int frame_index, const FeatureView& y, uint32_t threshold, SpotMatch* match)
+{
+    return updateImpl(frame, frame_index, y, threshold, match);
+}
+
+bool SubsequenceDTW::update(const FeatureView& frame, int frame_index, const QuantizedView& y, uint32_t threshold, SpotMatch* match)
+{
+    return updateImpl(frame, frame_index, y, threshold, match);
+}
+
+template<class Y>
+bool SubsequenceDTW::updateImpl(const FeatureView& frame, int frame_index, const Y& y, uint32_t threshold, SpotMatch* match)
+{
+    const int m = y.frame_num;
+    if (m != cost_.size()) { return false; }
+
+    // cost_ holds D(t-1, j) and is overwritten with D(t, j) in place.
+    uint32_t diag_cost = kInfinity;
+    int diag_start = frame_index;
+    for (int j = 0; j < m; j++)
+    {
+        const uint32_t up_cost = cost_[j];
+        const int up_start = start_[j];
+        uint32_t best = 0;
+        int best_start = frame_index;
+        if (j > 0)
+        {
+            best = diag_cost;
+            best_start = diag_start;
+            if (up_cost < best) { best = up_cost; best_start = up_start; }
+            if (cost_[j - 1] < best) { best = cost_[j - 1]; best_start = start_[j - 1]; }
+        }
+        diag_cost = up_cost;
+        diag_start = up_start;
+        cost_[j] = (best == kInfinity) ? kInfinity : best + kernel::distance<0>(frame, 0, y, j);
+        start_[j] = best_start;
+    }
+
+    // The candidate is final when every path that could still beat it starts after it.
+    bool is_reported = false;
+    if (candidate_.score != UINT32_MAX)
+    {
+        bool is_final = true;
+        for (int j = 0; j < m; j++)
+        {
+            if (cost_[j] < candidate_cost_ && start_[j] <= candidate_.end_frame)
+            {
+                is_final = false;
+                break;
+            }
+        }
+        if (is_final)
+        {
+            *match = candidate_;
+            is_reported = true;
+            for (int j = 0; j < m; j++)
+            {
+                if (start_[j] <= candidate_.end_frame) { cost_[j] = kInfinity; }
+            }
+            candidate_.score = UINT32_MAX;
+            candidate_cost_ = kInfinity;
+        }
+    }
+
+    const uint32_t end_cost = cost_[m - 1];
+    if (end_cost != kInfinity)
+    {
+        const uint32_t score = end_cost / (frame_index - start_[m - 1] + 1 + m);
+        if (score < threshold && score < candidate_.score)
+        {
+            candidate_ = SpotMatch {
+                .score = score,
+                .start_frame = start_[m - 1],
+                .end_frame = frame_index
+            };
+            candidate_cost_ = end_cost;
+        }
+    }
+    return is_reported;
+}
+
+} // namespace cmdvox
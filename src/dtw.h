@@ -0,0 +1,159 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_DTW_H_
+#define CMDVOX_DTW_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include <simplevox.h>
+
+#include "quantized_feature.h"
+
+namespace cmdvox
+{
+
+/**
+ * @brief read-only view of a frame-major feature matrix (frame_num x coef_num)
+ */
+struct FeatureView
+{
+    const int16_t* data;
+    int frame_num;
+    int coef_num;
+
+    const int16_t* frame(int index) const { return &data[index * coef_num]; }
+};
+
+FeatureView viewOf(const simplevox::MfccFeature& feature);
+
+/**
+ * @brief result of DTW
+ */
+struct DtwScore
+{
+    uint32_t score;             // cost / (frame_num_x + frame_num_y), same as simplevox::calcDTW
+    uint32_t normalized_score;  // cost / warping path length
+};
+
+constexpr DtwScore kNoScore = { UINT32_MAX, UINT32_MAX };
+
+/**
+ * @brief warping path of a coarse DTW (cells in coarse frame indices)
+ */
+struct WarpingPath
+{
+    std::vector<int> x;
+    std::vector<int> y;
+
+    void clear() { x.clear(); y.clear(); }
+};
+
+/**
+ * @brief working storage of the DTW kernels
+ * @note The rows run along the shorter sequence, so the storage is O(min(x, y))
+ *       except the steps of the coarse pass. Once reserved, scoring does not allocate.
+ */
+struct DtwScratch
+{
+    std::vector<uint32_t> cost[2];
+    std::vector<uint16_t> length[2];
+    std::vector<uint8_t> steps;     // coarse steps (ceil(x / factor) x ceil(y / factor))
+    WarpingPath path;               // coarse warping path
+
+    /**
+     * @brief Grows the storage for the frame counts (never shrinks).
+     * @param[in] coarse_factor decimation factor of the coarse pass (<= 1: no coarse pass)
+     */
+    void reserve(int x_frame_num, int y_frame_num, int coarse_factor = 1);
+};
+
+/**
+ * @brief Averages every `factor` frames into one frame.
+ * @return decimated feature (ceil(frame_num / factor) frames)
+ */
+simplevox::MfccFeature* decimateFeature(const simplevox::MfccFeature& feature, int factor);
+/**
+ * @brief Averages every `factor` frames into the given buffer.
+ * @param[out] dest     ceil(frame_num / factor) x coef_num values
+ * @return view of dest
+ */
+FeatureView decimateFeature(const FeatureView& feature, int factor, int16_t* dest);
+
+/**
+ * @brief Calculates the DTW score.
+ * @note The local distance, step pattern and normalization are the same as simplevox::calcDTW.
+ * @param[in] bound     the calculation is abandoned once the score cannot be lower than bound
+ * @return kNoScore if abandoned
+ */
+DtwScore calcDTW(const FeatureView& x, const FeatureView& y, uint32_t bound = UINT32_MAX);
+DtwScore calcDTW(const FeatureView& x, const QuantizedView& y, uint32_t bound = UINT32_MAX);
+
+/**
+ * @brief Calculates the DTW score and the warping path on coarse features.
+ * @note The local distance, step pattern and normalization are the same as simplevox::calcDTW.
+ */
+uint32_t calcCoarseDTW(const FeatureView& x, const FeatureView& y, WarpingPath* path);
+
+/**
+ * @brief Calculates the DTW score only inside a corridor around a projected coarse path.
+ * @param[in] path      warping path of the decimated features
+ * @param[in] factor    decimation factor of the path
+ * @param[in] radius    corridor half width in full-resolution frames
+ * @param[in] bound     the calculation is abandoned once the score cannot be lower than bound
+ * @return approximated score of simplevox::calcDTW (never lower than the exact score)
+ */
+DtwScore calcCorridorDTW(const FeatureView& x, const FeatureView& y, const WarpingPath& path, int factor, int radius, uint32_t bound = UINT32_MAX);
+DtwScore calcCorridorDTW(const FeatureView& x, const QuantizedView& y, const WarpingPath& path, int factor, int radius, uint32_t bound = UINT32_MAX);
+
+/**
+ * @brief match of a template in a frame stream
+ */
+struct SpotMatch
+{
+    uint32_t score;     // same normalization as calcDTW
+    int start_frame;
+    int end_frame;
+};
+
+/**
+ * @brief streaming subsequence DTW of one template against an unbounded frame stream
+ * @note A match is reported once no path overlapping it can improve it (SPRING).
+ *       The state is O(template length).
+ */
+class SubsequenceDTW
+{
+public:
+    void init(int frame_num);
+    void reset();
+
+    /**
+     * @brief Advances the stream by one frame.
+     * @param[in] frame         query frame (frame_num = 1)
+     * @param[in] frame_index   index of the frame in the stream
+     * @param[out] match        reported match
+     * @return true if a match is reported
+     */
+    bool update(const FeatureView& frame, int frame_index, const FeatureView& y, uint32_t threshold, SpotMatch* match);
+    bool update(const FeatureView& frame, int frame_index, const QuantizedView& y, uint32_t threshold, SpotMatch* match);
+
+private:
+    template<class Y>
+    bool updateImpl(const FeatureView& frame, int frame_index, const Y& y, uint32_t threshold, SpotMatch* match);
+
+    std::vector<uint32_t> cost_;
+    std::vector<int> start_;
+    SpotMatch candidate_;
+    uint32_t candidate_cost_;
+};
+
+} // namespace cmdvox
+
+#endif // CMDVOX_DTW_H_
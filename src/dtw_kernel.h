@@ -0,0 +1,343 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_DTW_KERNEL_H_
+#define CMDVOX_DTW_KERNEL_H_
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dtw.h"
+#include "quantized_feature.h"
+
+namespace cmdvox
+{
+
+/**
+ * @brief DTW kernels specialized for a coefficient count
+ * @note The commander calls the kernels through this table,
+ *       so that the fixed commander shares the scoring code with the runtime one.
+ *       The scratch must be reserved for the frame counts beforehand.
+ */
+struct DtwKernels
+{
+    DtwScore (*full)(const FeatureView& x, const FeatureView& y, uint32_t bound, DtwScratch* scratch);
+    DtwScore (*full_q8)(const FeatureView& x, const QuantizedView& y, uint32_t bound, DtwScratch* scratch);
+    uint32_t (*coarse)(const FeatureView& x, const FeatureView& y, DtwScratch* scratch);
+    DtwScore (*corridor)(const FeatureView& x, const FeatureView& y, const WarpingPath& path, int factor, int radius, uint32_t bound, DtwScratch* scratch);
+    DtwScore (*corridor_q8)(const FeatureView& x, const QuantizedView& y, const WarpingPath& path, int factor, int radius, uint32_t bound, DtwScratch* scratch);
+};
+
+namespace kernel
+{
+
+constexpr uint32_t kInfinity = UINT32_MAX;
+
+/**
+ * @brief local distance (L1) of frames
+ * @tparam CoefNum  coefficient count known at compile time (0: given at runtime)
+ */
+template<int CoefNum>
+struct L1Distance
+{
+    static uint32_t calc(const int16_t* a, const int16_t* b, int)
+    {
+        uint32_t sum = 0;
+#pragma GCC unroll 32
+        for (int k = 0; k < CoefNum; k++)
+        {
+            sum += abs(a[k] - b[k]);
+        }
+        return sum;
+    }
+
+    static uint32_t calc(const int16_t* a, const int8_t* b, const QuantizedView& y)
+    {
+        uint32_t sum = 0;
+#pragma GCC unroll 32
+        for (int k = 0; k < CoefNum; k++)
+        {
+            sum += abs(a[k] - (b[k] * (1 << y.shift[k]) + y.offset[k]));
+        }
+        return sum;
+    }
+};
+
+template<>
+struct L1Distance<0>
+{
+    static uint32_t calc(const int16_t* a, const int16_t* b, int coef_num)
+    {
+        uint32_t sum = 0;
+        for (int k = 0; k < coef_num; k++)
+        {
+            sum += abs(a[k] - b[k]);
+        }
+        return sum;
+    }
+
+    static uint32_t calc(const int16_t* a, const int8_t* b, const QuantizedView& y)
+    {
+        uint32_t sum = 0;
+        for (int k = 0; k < y.coef_num; k++)
+        {
+            sum += abs(a[k] - (b[k] * (1 << y.shift[k]) + y.offset[k]));
+        }
+        return sum;
+    }
+};
+
+template<int CoefNum>
+inline uint32_t distance(const FeatureView& x, int i, const FeatureView& y, int j)
+{
+    return L1Distance<CoefNum>::calc(x.frame(i), y.frame(j), x.coef_num);
+}
+
+template<int CoefNum>
+inline uint32_t distance(const FeatureView& x, int i, const QuantizedView& y, int j)
+{
+    return L1Distance<CoefNum>::calc(x.frame(i), y.frame(j), y);
+}
+
+enum Step : uint8_t
+{
+    Diagonal,
+    Vertical,
+    Horizontal,
+};
+
+/**
+ * @brief Selects the predecessor of lower cost (the shorter path on a tie).
+ * @note The tie rule makes the result independent of which sequence runs along the rows.
+ */
+inline void select(uint32_t cost, uint16_t length, uint32_t* best, uint16_t* best_length)
+{
+    if (cost < *best || (cost == *best && length < *best_length))
+    {
+        *best = cost;
+        *best_length = length;
+    }
+}
+
+inline DtwScore makeScore(uint32_t cost, uint16_t length, int n, int m)
+{
+    if (cost == kInfinity) { return kNoScore; }
+    return DtwScore {
+        .score = cost / (n + m),
+        .normalized_score = cost / length
+    };
+}
+
+/**
+ * @brief Calculates the cumulative cost with two rows of cols cells.
+ * @param[in] distance  local distance of (row, col)
+ */
+template<class D>
+DtwScore fullCore(int rows, int cols, uint64_t limit, DtwScratch* scratch, D distance)
+{
+    uint32_t* prev = scratch->cost[0].data();
+    uint32_t* cur = scratch->cost[1].data();
+    uint16_t* prev_length = scratch->length[0].data();
+    uint16_t* cur_length = scratch->length[1].data();
+    for (int i = 0; i < rows; i++)
+    {
+        uint32_t row_min = kInfinity;
+        for (int j = 0; j < cols; j++)
+        {
+            uint32_t best = (i == 0 && j == 0) ? 0 : kInfinity;
+            uint16_t length = 0;
+            if (i > 0 && j > 0) { select(prev[j - 1], prev_length[j - 1], &best, &length); }
+            if (i > 0) { select(prev[j], prev_length[j], &best, &length); }
+            if (j > 0) { select(cur[j - 1], cur_length[j - 1], &best, &length); }
+            cur[j] = best + distance(i, j);
+            cur_length[j] = length + 1;
+            row_min = std::min(row_min, cur[j]);
+        }
+        // The cumulative cost never decreases, so the row minimum bounds the final cost.
+        if (row_min >= limit) { return kNoScore; }
+        std::swap(prev, cur);
+        std::swap(prev_length, cur_length);
+    }
+    return makeScore(prev[cols - 1], prev_length[cols - 1], rows, cols);
+}
+
+template<int CoefNum, class Y>
+DtwScore fullDTW(const FeatureView& x, const Y& y, uint32_t bound, DtwScratch* scratch)
+{
+    const int n = x.frame_num;
+    const int m = y.frame_num;
+    if (n == 0 || m == 0) { return kNoScore; }
+    const uint64_t limit = static_cast<uint64_t>(bound) * (n + m);
+
+    // The rows run along the longer sequence, so that the scratch is O(min(n, m)).
+    if (m <= n)
+    {
+        return fullCore(n, m, limit, scratch, [&](int i, int j) { return distance<CoefNum>(x, i, y, j); });
+    }
+    return fullCore(m, n, limit, scratch, [&](int j, int i) { return distance<CoefNum>(x, i, y, j); });
+}
+
+/**
+ * @brief Calculates the cost and the warping path on coarse features.
+ * @param[in] is_transposed true if the rows are y
+ * @note On a tie the step is chosen in the order of diagonal, x and y regardless of the orientation.
+ */
+template<class D>
+uint32_t coarseCore(int rows, int cols, bool is_transposed, DtwScratch* scratch, D distance)
+{
+    uint32_t* prev = scratch->cost[0].data();
+    uint32_t* cur = scratch->cost[1].data();
+    uint8_t* steps = scratch->steps.data();
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            uint32_t best = (i == 0 && j == 0) ? 0 : kInfinity;
+            uint8_t step = Diagonal;
+            if (i > 0 && j > 0) { best = prev[j - 1]; }
+            if (!is_transposed && i > 0 && prev[j] < best) { best = prev[j]; step = Vertical; }
+            if (j > 0 && cur[j - 1] < best) { best = cur[j - 1]; step = Horizontal; }
+            if (is_transposed && i > 0 && prev[j] < best) { best = prev[j]; step = Vertical; }
+            cur[j] = best + distance(i, j);
+            steps[i * cols + j] = step;
+        }
+        std::swap(prev, cur);
+    }
+
+    auto& path = scratch->path;
+    path.clear();
+    int i = rows - 1;
+    int j = cols - 1;
+    while (true)
+    {
+        path.x.push_back(is_transposed ? j : i);
+        path.y.push_back(is_transposed ? i : j);
+        if (i == 0 && j == 0) { break; }
+        switch (steps[i * cols + j])
+        {
+        case Diagonal: i--; j--; break;
+        case Vertical: i--; break;
+        case Horizontal: j--; break;
+        }
+    }
+    std::reverse(path.x.begin(), path.x.end());
+    std::reverse(path.y.begin(), path.y.end());
+    return prev[cols - 1];
+}
+
+template<int CoefNum>
+uint32_t coarseDTW(const FeatureView& x, const FeatureView& y, DtwScratch* scratch)
+{
+    const int n = x.frame_num;
+    const int m = y.frame_num;
+    if (n == 0 || m == 0) { return kInfinity; }
+
+    const uint32_t cost = (m <= n)
+        ? coarseCore(n, m, false, scratch, [&](int i, int j) { return distance<CoefNum>(x, i, y, j); })
+        : coarseCore(m, n, true, scratch, [&](int j, int i) { return distance<CoefNum>(x, i, y, j); });
+    return cost / (n + m);
+}
+
+/**
+ * @brief Calculates the cumulative cost inside the projected corridor with two rows of cols cells.
+ * @param[in] row_path  path cells along the rows (monotone)
+ * @param[in] col_path  path cells along the columns
+ */
+template<class D>
+DtwScore corridorCore(int rows, int cols, const std::vector<int>& row_path, const std::vector<int>& col_path,
+    int factor, int radius, uint64_t limit, DtwScratch* scratch, D distance)
+{
+    uint32_t* prev = scratch->cost[0].data();
+    uint32_t* cur = scratch->cost[1].data();
+    uint16_t* prev_length = scratch->length[0].data();
+    uint16_t* cur_length = scratch->length[1].data();
+    std::fill(prev, prev + cols, kInfinity);
+    std::fill(cur, cur + cols, kInfinity);
+
+    // The path is monotone, so the cells whose projection covers a row form a range that only moves forward.
+    const int cell_num = row_path.size();
+    int first = 0;
+    int last = -1;
+    int prev_lo = 0, prev_hi = -1;
+    int cur_lo = 0, cur_hi = -1;
+    for (int i = 0; i < rows; i++)
+    {
+        while (first < cell_num && row_path[first] * factor + factor + radius <= i) { first++; }
+        while (last + 1 < cell_num && row_path[last + 1] * factor - radius <= i) { last++; }
+        const bool is_covered = first <= last;
+        const int lo = is_covered ? std::max(col_path[first] * factor - radius, 0) : cols;
+        const int hi = is_covered ? std::min(col_path[last] * factor + factor - 1 + radius, cols - 1) : -1;
+
+        // Cells outside the window of each row stay infinity.
+        std::fill(cur + cur_lo, cur + cur_hi + 1, kInfinity);
+        uint32_t row_min = kInfinity;
+        for (int j = lo; j <= hi; j++)
+        {
+            uint32_t best = (i == 0 && j == 0) ? 0 : kInfinity;
+            uint16_t length = 0;
+            if (i > 0 && j > 0) { select(prev[j - 1], prev_length[j - 1], &best, &length); }
+            if (i > 0) { select(prev[j], prev_length[j], &best, &length); }
+            if (j > 0) { select(cur[j - 1], cur_length[j - 1], &best, &length); }
+            cur[j] = (best == kInfinity) ? kInfinity : best + distance(i, j);
+            cur_length[j] = length + 1;
+            row_min = std::min(row_min, cur[j]);
+        }
+        if (row_min >= limit) { return kNoScore; }
+        cur_lo = lo;
+        cur_hi = hi;
+        std::swap(prev, cur);
+        std::swap(prev_length, cur_length);
+        std::swap(prev_lo, cur_lo);
+        std::swap(prev_hi, cur_hi);
+    }
+    return makeScore(prev[cols - 1], prev_length[cols - 1], rows, cols);
+}
+
+template<int CoefNum, class Y>
+DtwScore corridorDTW(const FeatureView& x, const Y& y, const WarpingPath& path, int factor, int radius, uint32_t bound, DtwScratch* scratch)
+{
+    const int n = x.frame_num;
+    const int m = y.frame_num;
+    if (n == 0 || m == 0) { return kNoScore; }
+    const uint64_t limit = static_cast<uint64_t>(bound) * (n + m);
+
+    if (m <= n)
+    {
+        return corridorCore(n, m, path.x, path.y, factor, radius, limit, scratch,
+            [&](int i, int j) { return distance<CoefNum>(x, i, y, j); });
+    }
+    return corridorCore(m, n, path.y, path.x, factor, radius, limit, scratch,
+        [&](int j, int i) { return distance<CoefNum>(x, i, y, j); });
+}
+
+} // namespace kernel
+
+/**
+ * @brief Returns the kernels for the coefficient count.
+ * @tparam CoefNum  coefficient count known at compile time (0: given at runtime)
+ * @note Features of another coefficient count must not be scored with a specialized table.
+ */
+template<int CoefNum>
+const DtwKernels& dtwKernels()
+{
+    static const DtwKernels kernels {
+        .full = kernel::fullDTW<CoefNum, FeatureView>,
+        .full_q8 = kernel::fullDTW<CoefNum, QuantizedView>,
+        .coarse = kernel::coarseDTW<CoefNum>,
+        .corridor = kernel::corridorDTW<CoefNum, FeatureView>,
+        .corridor_q8 = kernel::corridorDTW<CoefNum, QuantizedView>
+    };
+    return kernels;
+}
+
+} // namespace cmdvox
+
+#endif // CMDVOX_DTW_KERNEL_H_
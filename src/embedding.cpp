@@ -0,0 +1,109 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include "embedding.h"
+
+#include <algorithm>
+#include <math.h>
+
+namespace cmdvox
+{
+
+void EmbeddingIndex::embed(const FeatureView& feature, float* dest)
+{
+    const int coef_num = feature.coef_num;
+    const int frame_num = feature.frame_num;
+    if (frame_num <= 0)
+    {
+        std::fill_n(dest, lengthOf(coef_num), 0.0f);
+        return;
+    }
+    for (int s = 0; s < kSegmentNum; s++)
+    {
+        // Features shorter than kSegmentNum frames share frames between segments.
+        const int begin = std::min(s * frame_num / kSegmentNum, frame_num - 1);
+        const int end = std::max((s + 1) * frame_num / kSegmentNum, begin + 1);
+        float* mean = &dest[s * coef_num];
+        std::fill_n(mean, coef_num, 0.0f);
+        for (int i = begin; i < end; i++)
+        {
+            const int16_t* frame = feature.frame(i);
+            for (int k = 0; k < coef_num; k++) { mean[k] += frame[k]; }
+        }
+        for (int k = 0; k < coef_num; k++) { mean[k] /= (end - begin); }
+    }
+
+    float* deviation = &dest[kSegmentNum * coef_num];
+    for (int k = 0; k < coef_num; k++)
+    {
+        float sum = 0.0f;
+        float square_sum = 0.0f;
+        for (int i = 0; i < frame_num; i++)
+        {
+            const float value = feature.frame(i)[k];
+            sum += value;
+            square_sum += value * value;
+        }
+        const float mean = sum / frame_num;
+        deviation[k] = sqrtf(std::max(square_sum / frame_num - mean * mean, 0.0f));
+    }
+}
+
+uint32_t EmbeddingIndex::distance(const float* x, const float* y, int length)
+{
+    // Independent partial sums let the compiler keep four lanes in flight.
+    float sum[4] = {};
+    int k = 0;
+    for (; k + 4 <= length; k += 4)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            const float diff = x[k + lane] - y[k + lane];
+            sum[lane] += diff * diff;
+        }
+    }
+    for (; k < length; k++)
+    {
+        const float diff = x[k] - y[k];
+        sum[0] += diff * diff;
+    }
+    return static_cast<uint32_t>(lroundf((sum[0] + sum[1] + sum[2] + sum[3]) / length));
+}
+
+void EmbeddingIndex::add(const std::vector<float>& embedding)
+{
+    length_ = embedding.size();
+    matrix_.insert(matrix_.end(), embedding.begin(), embedding.end());
+    row_num_++;
+}
+
+int EmbeddingIndex::search(const float* query, EmbeddingMatch* matches, int max_count) const
+{
+    if (max_count <= 0) { return 0; }
+
+    int count = 0;
+    for (int row = 0; row < row_num_; row++)
+    {
+        const uint32_t d = distance(query, &matrix_[row * length_], length_);
+        if (count == max_count && matches[count - 1].distance <= d) { continue; }
+
+        // Insertion into the sorted matches (max_count is a few)
+        int index = std::min(count, max_count - 1);
+        while (index > 0 && matches[index - 1].distance > d)
+        {
+            matches[index] = matches[index - 1];
+            index--;
+        }
+        matches[index] = EmbeddingMatch{ row, d };
+        if (count < max_count) { count++; }
+    }
+    return count;
+}
+
+} // namespace cmdvox
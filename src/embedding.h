@@ -0,0 +1,63 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_EMBEDDING_H_
+#define CMDVOX_EMBEDDING_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include "dtw.h"
+
+namespace cmdvox
+{
+
+struct EmbeddingMatch
+{
+    int row;
+    uint32_t distance;  // mean squared difference per dimension
+};
+
+/**
+ * @brief fixed-size embeddings of MFCC features in a contiguous matrix
+ * @note An embedding is the per-coefficient mean of kSegmentNum equal time segments
+ *       followed by the per-coefficient standard deviation of the whole feature.
+ */
+class EmbeddingIndex
+{
+public:
+    static constexpr int kSegmentNum = 4;
+
+    static int lengthOf(int coef_num) { return (kSegmentNum + 1) * coef_num; }
+    /**
+     * @param[out] dest     lengthOf(feature.coef_num) values (all zero for a feature without frames)
+     */
+    static void embed(const FeatureView& feature, float* dest);
+    static uint32_t distance(const float* x, const float* y, int length);
+
+    void clear() { matrix_.clear(); row_num_ = 0; }
+    void add(const std::vector<float>& embedding);
+    int size() const { return row_num_; }
+
+    /**
+     * @brief Scans all rows for the nearest ones.
+     * @param[out] matches  up to max_count rows in ascending order of distance
+     * @return number of the matches
+     */
+    int search(const float* query, EmbeddingMatch* matches, int max_count) const;
+
+private:
+    int length_ = 0;
+    int row_num_ = 0;
+    std::vector<float> matrix_;
+};
+
+} // namespace cmdvox
+
+#endif // CMDVOX_EMBEDDING_H_
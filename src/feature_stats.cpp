@@ -0,0 +1,89 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include "feature_stats.h"
+
+#include <algorithm>
+#include <math.h>
+
+namespace cmdvox
+{
+
+void FeatureStats::init(int coef_num)
+{
+    coef_num_ = coef_num;
+    sum_.assign(coef_num, 0.0f);
+    square_sum_.assign(coef_num, 0.0f);
+    mean_.assign(coef_num, 0.0f);
+    gain_.assign(coef_num, 0.0f);
+    frame_num_ = 0;
+}
+
+void FeatureStats::clear()
+{
+    std::fill(sum_.begin(), sum_.end(), 0.0f);
+    std::fill(square_sum_.begin(), square_sum_.end(), 0.0f);
+    frame_num_ = 0;
+}
+
+void FeatureStats::add(const float* frame)
+{
+    for (int k = 0; k < coef_num_; k++)
+    {
+        sum_[k] += frame[k];
+        square_sum_[k] += frame[k] * frame[k];
+    }
+    frame_num_++;
+}
+
+void FeatureStats::remove(const float* frames, int frame_num)
+{
+    for (int i = 0; i < frame_num; i++)
+    {
+        const float* frame = &frames[i * coef_num_];
+        for (int k = 0; k < coef_num_; k++)
+        {
+            sum_[k] -= frame[k];
+            square_sum_[k] -= frame[k] * frame[k];
+        }
+    }
+    frame_num_ -= frame_num;
+}
+
+void FeatureStats::rebuild(const float* frames, int frame_num)
+{
+    clear();
+    for (int i = 0; i < frame_num; i++)
+    {
+        add(&frames[i * coef_num_]);
+    }
+}
+
+void FeatureStats::normalize(const float* src, int frame_num, int16_t* dest) const
+{
+    if (frame_num_ <= 0) { return; }
+
+    for (int k = 0; k < coef_num_; k++)
+    {
+        mean_[k] = sum_[k] / frame_num_;
+        const float variance = std::max(square_sum_[k] / frame_num_ - mean_[k] * mean_[k], 1e-6f);
+        gain_[k] = kScale / sqrtf(variance);
+    }
+
+    for (int i = 0; i < frame_num; i++)
+    {
+        for (int k = 0; k < coef_num_; k++)
+        {
+            const float value = (src[i * coef_num_ + k] - mean_[k]) * gain_[k];
+            dest[i * coef_num_ + k] = static_cast<int16_t>(std::min(std::max(value, -32768.0f), 32767.0f));
+        }
+    }
+}
+
+} // namespace cmdvox
@@ -0,0 +1,55 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_FEATURE_STATS_H_
+#define CMDVOX_FEATURE_STATS_H_
+
+#include <vector>
+#include <stdint.h>
+
+namespace cmdvox
+{
+
+/**
+ * @brief running per-coefficient statistics of MFCC frames
+ * @note Frames are added as they are calculated and removed when they are trimmed,
+ *       so that normalization needs no extra pass over the frames.
+ */
+class FeatureStats
+{
+public:
+    void init(int coef_num);
+    void clear();
+
+    void add(const float* frame);
+    void remove(const float* frames, int frame_num);
+    /**
+     * @brief Recalculates the sums from the frames, discarding the rounding error of past add/remove calls.
+     */
+    void rebuild(const float* frames, int frame_num);
+
+    /**
+     * @brief Normalizes frames to zero mean and unit variance (scaled by kScale) per coefficient.
+     */
+    void normalize(const float* src, int frame_num, int16_t* dest) const;
+
+    static constexpr float kScale = 256.0f;
+
+private:
+    int coef_num_ = 0;
+    int frame_num_ = 0;
+    std::vector<float> sum_;
+    std::vector<float> square_sum_;
+    mutable std::vector<float> mean_;
+    mutable std::vector<float> gain_;
+};
+
+} // namespace cmdvox
+
+#endif // CMDVOX_FEATURE_STATS_H_
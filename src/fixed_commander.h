@@ -0,0 +1,114 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_FIXED_COMMANDER_H_
+#define CMDVOX_FIXED_COMMANDER_H_
+
+#include <stdint.h>
+
+#include "cmdvox.h"
+#include "dtw_kernel.h"
+
+namespace cmdvox
+{
+
+/**
+ * @brief configuration known at compile time
+ * @note The lengths are derived in the same way as MfccCommander::init.
+ */
+template<int SampleRate, int CoefNum, int LimitTimeMs, int VadFrameMs = 10, int MfccFrameMs = 25, int MfccHopMs = 10>
+struct FixedConfig
+{
+    static constexpr int sample_rate = SampleRate;
+    static constexpr int coef_num = CoefNum;
+    static constexpr int limit_time_ms = LimitTimeMs;
+    static constexpr int vad_frame_ms = VadFrameMs;
+    static constexpr int mfcc_frame_ms = MfccFrameMs;
+    static constexpr int mfcc_hop_ms = MfccHopMs;
+
+    static constexpr int vad_frame_length = SampleRate * VadFrameMs / 1000;
+    static constexpr int mfcc_frame_length = SampleRate * MfccFrameMs / 1000;
+    static constexpr int mfcc_hop_length = SampleRate * MfccHopMs / 1000;
+    static constexpr int max_frame_num = (SampleRate * LimitTimeMs / 1000 - (mfcc_frame_length - mfcc_hop_length)) / mfcc_hop_length;
+    static constexpr int raw_max_length = (vad_frame_length > mfcc_frame_length ? vad_frame_length : mfcc_frame_length) * 2;
+
+    static_assert(CoefNum > 0, "CoefNum must be positive");
+    static_assert(max_frame_num > 0, "LimitTimeMs is too short for the MFCC frame");
+
+    /**
+     * @brief Returns the runtime config with the fixed values applied.
+     */
+    static CommanderConfig apply(CommanderConfig config)
+    {
+        config.capture_rate = SampleRate;
+        config.vad_config.sample_rate = SampleRate;
+        config.vad_config.frame_time_ms = VadFrameMs;
+        config.mfcc_config.sample_rate = SampleRate;
+        config.mfcc_config.frame_time_ms = MfccFrameMs;
+        config.mfcc_config.hop_time_ms = MfccHopMs;
+        config.mfcc_config.coef_num = CoefNum;
+        config.limit_time_ms = LimitTimeMs;
+        return config;
+    }
+
+    static bool matches(const CommanderConfig& config)
+    {
+        return (config.capture_rate == 0 || config.capture_rate == SampleRate)
+            && config.vad_config.sample_rate == SampleRate
+            && config.vad_config.frame_length() == vad_frame_length
+            && config.mfcc_config.sample_rate == SampleRate
+            && config.mfcc_config.frame_length() == mfcc_frame_length
+            && config.mfcc_config.hop_length() == mfcc_hop_length
+            && config.mfcc_config.coef_num == CoefNum
+            && config.limit_time_ms == LimitTimeMs;
+    }
+};
+
+/**
+ * @brief commander specialized for a fixed configuration
+ * @note The sample queue, the MFCC frames and the query feature are members, and
+ *       the DTW distance is unrolled for CoefNum. Everything else is shared with MfccCommander.
+ *       The optional buffers (continuous capture, endpoint energies, spotting, gate), the DTW scratch
+ *       and the feature statistics are still allocated on the heap by MfccCommander::init.
+ *       lazy_feature needs a longer queue than raw_max_length and is rejected at init.
+ * @tparam Fixed    FixedConfig
+ */
+template<class Fixed>
+class FixedMfccCommander : public MfccCommander
+{
+public:
+    using Config = Fixed;
+
+    /**
+     * @brief Initializes with the config made by Fixed::apply.
+     * @return false if the config differs from the fixed values
+     */
+    bool init(const CommanderConfig& config)
+    {
+        if (!Fixed::matches(config)) { return false; }
+
+        const CommanderBuffers buffers {
+            .raw_queue = raw_queue_buffer_,
+            .raw_queue_length = Fixed::raw_max_length,
+            .raw_mfcc = raw_mfcc_buffer_,
+            .raw_mfcc_length = Fixed::max_frame_num * Fixed::coef_num,
+            .query_feature = query_feature_buffer_
+        };
+        return MfccCommander::init(config, &buffers, dtwKernels<Fixed::coef_num>());
+    }
+
+private:
+    int16_t raw_queue_buffer_[Fixed::raw_max_length];
+    float raw_mfcc_buffer_[Fixed::max_frame_num * Fixed::coef_num];
+    int16_t query_feature_buffer_[Fixed::max_frame_num * Fixed::coef_num];
+};
+
+} // namespace cmdvox
+
+#endif // CMDVOX_FIXED_COMMANDER_H_
@@ -0,0 +1,142 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include "quantized_feature.h"
+#include "dtw.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+
+constexpr char kMagic[4] = { 'C', 'V', 'Q', '8' };
+
+}
+
+
+namespace cmdvox
+{
+
+QuantizedView viewOf(const QuantizedFeature& feature)
+{
+    return QuantizedView {
+        .data = feature.data.data(),
+        .offset = feature.offset.data(),
+        .shift = feature.shift.data(),
+        .frame_num = feature.frame_num,
+        .coef_num = feature.coef_num
+    };
+}
+
+QuantizedFeature* quantizeFeature(const simplevox::MfccFeature& feature)
+{
+    const auto src = viewOf(feature);
+    auto dest = new QuantizedFeature {
+        .frame_num = src.frame_num,
+        .coef_num = src.coef_num,
+        .offset = std::vector<int16_t>(src.coef_num),
+        .shift = std::vector<uint8_t>(src.coef_num),
+        .data = std::vector<int8_t>(src.frame_num * src.coef_num)
+    };
+
+    for (int k = 0; k < src.coef_num; k++)
+    {
+        int32_t min_value = INT16_MAX;
+        int32_t max_value = INT16_MIN;
+        for (int i = 0; i < src.frame_num; i++)
+        {
+            min_value = std::min<int32_t>(min_value, src.frame(i)[k]);
+            max_value = std::max<int32_t>(max_value, src.frame(i)[k]);
+        }
+        const int32_t offset = (min_value + max_value) / 2;
+        const int32_t half_range = std::max(max_value - offset, offset - min_value);
+        int shift = 0;
+        while ((half_range >> shift) > INT8_MAX) { shift++; }
+
+        dest->offset[k] = offset;
+        dest->shift[k] = shift;
+        const int32_t round = (shift > 0) ? (1 << (shift - 1)) : 0;
+        for (int i = 0; i < src.frame_num; i++)
+        {
+            const int32_t value = (src.frame(i)[k] - offset + round) >> shift;
+            dest->data[i * src.coef_num + k] = std::min<int32_t>(std::max<int32_t>(value, INT8_MIN), INT8_MAX);
+        }
+    }
+    return dest;
+}
+
+simplevox::MfccFeature* dequantizeFeature(const QuantizedFeature& feature)
+{
+    const auto src = viewOf(feature);
+    auto dest = new simplevox::MfccFeature(src.frame_num, src.coef_num);
+    int16_t* data = &dest->feature[0];
+    for (int i = 0; i < src.frame_num; i++)
+    {
+        for (int k = 0; k < src.coef_num; k++)
+        {
+            data[i * src.coef_num + k] = src.frame(i)[k] * (1 << src.shift[k]) + src.offset[k];
+        }
+    }
+    return dest;
+}
+
+bool saveQuantizedFile(const char* path, const QuantizedFeature& feature)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) { return false; }
+
+    const int32_t header[2] = { feature.frame_num, feature.coef_num };
+    bool is_success = fwrite(kMagic, sizeof(kMagic), 1, file) == 1
+        && fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(feature.offset.data(), sizeof(feature.offset[0]), feature.coef_num, file) == feature.coef_num
+        && fwrite(feature.shift.data(), sizeof(feature.shift[0]), feature.coef_num, file) == feature.coef_num
+        && fwrite(feature.data.data(), sizeof(feature.data[0]), feature.data.size(), file) == feature.data.size();
+    fclose(file);
+    return is_success;
+}
+
+QuantizedFeature* loadQuantizedFile(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) { return nullptr; }
+
+    char magic[sizeof(kMagic)];
+    int32_t header[2];
+    if (fread(magic, sizeof(magic), 1, file) != 1
+        || memcmp(magic, kMagic, sizeof(kMagic)) != 0
+        || fread(header, sizeof(header), 1, file) != 1
+        || header[0] <= 0 || header[1] <= 0)
+    {
+        fclose(file);
+        return nullptr;
+    }
+
+    auto feature = new QuantizedFeature {
+        .frame_num = header[0],
+        .coef_num = header[1],
+        .offset = std::vector<int16_t>(header[1]),
+        .shift = std::vector<uint8_t>(header[1]),
+        .data = std::vector<int8_t>(header[0] * header[1])
+    };
+    const bool is_success = fread(feature->offset.data(), sizeof(feature->offset[0]), feature->coef_num, file) == feature->coef_num
+        && fread(feature->shift.data(), sizeof(feature->shift[0]), feature->coef_num, file) == feature->coef_num
+        && fread(feature->data.data(), sizeof(feature->data[0]), feature->data.size(), file) == feature->data.size();
+    fclose(file);
+
+    if (!is_success)
+    {
+        delete feature;
+        return nullptr;
+    }
+    return feature;
+}
+
+} // namespace cmdvox
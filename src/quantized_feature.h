@@ -0,0 +1,63 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_QUANTIZED_FEATURE_H_
+#define CMDVOX_QUANTIZED_FEATURE_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include <simplevox.h>
+
+namespace cmdvox
+{
+
+/**
+ * @brief 8-bit quantized MFCC feature
+ * @note value = (data << shift[coef]) + offset[coef]
+ *
+ */
+struct QuantizedFeature
+{
+    int frame_num;
+    int coef_num;
+    std::vector<int16_t> offset;
+    std::vector<uint8_t> shift;
+    std::vector<int8_t> data;
+};
+
+/**
+ * @brief read-only view of a quantized feature
+ */
+struct QuantizedView
+{
+    const int8_t* data;
+    const int16_t* offset;
+    const uint8_t* shift;
+    int frame_num;
+    int coef_num;
+
+    const int8_t* frame(int index) const { return &data[index * coef_num]; }
+};
+
+QuantizedView viewOf(const QuantizedFeature& feature);
+
+QuantizedFeature* quantizeFeature(const simplevox::MfccFeature& feature);
+simplevox::MfccFeature* dequantizeFeature(const QuantizedFeature& feature);
+
+bool saveQuantizedFile(const char* path, const QuantizedFeature& feature);
+/**
+ * @brief Loads a quantized feature.
+ * @return nullptr if the file is not a quantized feature
+ */
+QuantizedFeature* loadQuantizedFile(const char* path);
+
+} // namespace cmdvox
+
+#endif // CMDVOX_QUANTIZED_FEATURE_H_
@@ -0,0 +1,355 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include "trace.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+namespace
+{
+
+constexpr char TAG[] = "CMDVOX";
+constexpr char kMagic[4] = { 'C', 'V', 'T', 'R' };
+
+}
+
+
+namespace cmdvox
+{
+
+bool TraceWriter::init(int capacity)
+{
+    deinit();
+    buffer_ = (uint8_t*)heap_caps_malloc(capacity, MALLOC_CAP_8BIT);
+    if (buffer_ == nullptr) { return false; }
+
+    capacity_ = capacity;
+    clear();
+    return true;
+}
+
+void TraceWriter::deinit()
+{
+    if (buffer_ != nullptr)
+    {
+        heap_caps_free(buffer_);
+        buffer_ = nullptr;
+    }
+    capacity_ = 0;
+}
+
+void TraceWriter::clear()
+{
+    head_ = 0;
+    length_ = 0;
+}
+
+void TraceWriter::writeReset()
+{
+    write(TraceType::Reset, nullptr, 0);
+}
+
+void TraceWriter::writeFrame(const FrameStats& stats, const int16_t* samples, int sample_num)
+{
+    const TraceFrame frame {
+        .vad_us = stats.vad_us,
+        .mfcc_us = stats.mfcc_us,
+        .frame_count = static_cast<uint16_t>(stats.frame_count),
+        .raw_length = static_cast<uint16_t>(stats.raw_length),
+        .sample_num = static_cast<uint16_t>(sample_num),
+        .vad_state = static_cast<uint8_t>(stats.vad_state),
+        .can_fetch = stats.can_fetch
+    };
+    write(TraceType::Frame, &frame, sizeof(frame), samples, sample_num);
+}
+
+void TraceWriter::writeSegment(int frame_num, uint32_t fetch_us)
+{
+    const TraceSegment segment {
+        .frame_num = static_cast<uint16_t>(frame_num),
+        .reserved = 0,
+        .fetch_us = fetch_us
+    };
+    write(TraceType::Segment, &segment, sizeof(segment));
+}
+
+void TraceWriter::writeScore(int index, uint32_t score)
+{
+    const TraceScore record {
+        .score = score,
+        .index = static_cast<int16_t>(index),
+        .reserved = 0
+    };
+    write(TraceType::Score, &record, sizeof(record));
+}
+
+void TraceWriter::writeDetect(int index, uint32_t score, uint32_t score_us)
+{
+    const TraceDetect detect {
+        .score = score,
+        .score_us = score_us,
+        .index = static_cast<int16_t>(index),
+        .reserved = 0
+    };
+    write(TraceType::Detect, &detect, sizeof(detect));
+}
+
+void TraceWriter::writeSync(const TraceSync& sync, const int16_t* raw, const int16_t* vad_history, const int16_t* mfcc_history,
+    const float* frames, const float* energy)
+{
+    const int raw_size = sync.raw_length * sizeof(*raw);
+    const int history_size = (sync.vad_history_length + sync.mfcc_history_length) * sizeof(*raw);
+    const int frame_size = sync.frame_count * sync.coef_num * sizeof(*frames);
+    const int energy_size = sync.has_energy ? sync.frame_count * sizeof(*energy) : 0;
+    if (!begin(TraceType::Sync, sizeof(sync) + raw_size + history_size + frame_size + energy_size)) { return; }
+
+    push(&sync, sizeof(sync));
+    push(raw, raw_size);
+    push(vad_history, sync.vad_history_length * sizeof(*vad_history));
+    push(mfcc_history, sync.mfcc_history_length * sizeof(*mfcc_history));
+    push(frames, frame_size);
+    push(energy, energy_size);
+}
+
+bool TraceWriter::flush(FILE* file)
+{
+    const uint32_t length = length_;
+    bool is_success = fwrite(kMagic, sizeof(kMagic), 1, file) == 1
+        && fwrite(&length, sizeof(length), 1, file) == 1;
+
+    // The ring may wrap around the end of the buffer.
+    const int first = std::min(length_, capacity_ - head_);
+    if (is_success && first > 0)
+    {
+        is_success = fwrite(&buffer_[head_], 1, first, file) == first;
+    }
+    if (is_success && length_ > first)
+    {
+        is_success = fwrite(buffer_, 1, length_ - first, file) == length_ - first;
+    }
+    fflush(file);
+    clear();
+    return is_success;
+}
+
+void TraceWriter::write(TraceType type, const void* payload, int size, const int16_t* samples, int sample_num)
+{
+    if (!begin(type, size + sample_num * sizeof(*samples))) { return; }
+
+    push(payload, size);
+    push(samples, sample_num * sizeof(*samples));
+}
+
+/**
+ * @brief Makes room for a record and writes its header.
+ * @return false if the record is not recorded
+ */
+bool TraceWriter::begin(TraceType type, int payload_size)
+{
+    if (buffer_ == nullptr) { return false; }
+
+    const int record_size = sizeof(TraceHeader) + payload_size;
+    if (record_size > capacity_) { return false; }
+
+    // Drop the oldest records until the new record fits.
+    while (capacity_ - length_ < record_size)
+    {
+        TraceHeader oldest;
+        peek(0, &oldest, sizeof(oldest));
+        const int oldest_size = sizeof(oldest) + oldest.size;
+        head_ = (head_ + oldest_size) % capacity_;
+        length_ -= oldest_size;
+    }
+
+    const TraceHeader header {
+        .sequence = sequence_++,
+        .size = static_cast<uint16_t>(payload_size),
+        .type = type,
+        .reserved = 0
+    };
+    push(&header, sizeof(header));
+    return true;
+}
+
+void TraceWriter::push(const void* data, int size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    int tail = (head_ + length_) % capacity_;
+    const int first = std::min(size, capacity_ - tail);
+    std::copy_n(bytes, first, &buffer_[tail]);
+    std::copy_n(&bytes[first], size - first, buffer_);
+    length_ += size;
+}
+
+void TraceWriter::peek(int offset, void* data, int size)
+{
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    const int begin = (head_ + offset) % capacity_;
+    const int first = std::min(size, capacity_ - begin);
+    std::copy_n(&buffer_[begin], first, bytes);
+    std::copy_n(buffer_, size - first, &bytes[first]);
+}
+
+bool TraceReader::open(const char* path)
+{
+    close();
+    file_ = fopen(path, "rb");
+    chunk_left_ = 0;
+    return (file_ != NULL);
+}
+
+void TraceReader::close()
+{
+    if (file_ != nullptr)
+    {
+        fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+bool TraceReader::next(TraceRecord* record)
+{
+    if (file_ == nullptr) { return false; }
+
+    while (chunk_left_ == 0)
+    {
+        char magic[sizeof(kMagic)];
+        if (fread(magic, sizeof(magic), 1, file_) != 1
+            || memcmp(magic, kMagic, sizeof(kMagic)) != 0
+            || fread(&chunk_left_, sizeof(chunk_left_), 1, file_) != 1)
+        {
+            return false;
+        }
+    }
+
+    if (fread(&record->header, sizeof(record->header), 1, file_) != 1) { return false; }
+
+    int payload_size = 0;
+    switch (record->header.type)
+    {
+    case TraceType::Frame: payload_size = sizeof(record->frame); break;
+    case TraceType::Segment: payload_size = sizeof(record->segment); break;
+    case TraceType::Score: payload_size = sizeof(record->score); break;
+    case TraceType::Detect: payload_size = sizeof(record->detect); break;
+    case TraceType::Sync: payload_size = sizeof(record->sync); break;
+    default: break;
+    }
+    if (payload_size > record->header.size
+        || (payload_size > 0 && fread(&record->frame, payload_size, 1, file_) != 1))
+    {
+        return false;
+    }
+
+    const int sample_num = (record->header.size - payload_size) / sizeof(int16_t);
+    record->samples.resize(sample_num);
+    if (sample_num > 0 && fread(record->samples.data(), sizeof(int16_t), sample_num, file_) != sample_num)
+    {
+        return false;
+    }
+
+    chunk_left_ -= sizeof(record->header) + record->header.size;
+    return true;
+}
+
+bool replayTrace(const char* path, MfccCommander* commander, ReplayReport* report)
+{
+    TraceReader reader;
+    if (!reader.open(path))
+    {
+        ESP_LOGE(TAG, "Failed to open trace: %s", path);
+        return false;
+    }
+
+    *report = ReplayReport {};
+    report->first_mismatch = -1;
+
+    TraceRecord record;
+    DetectResult result;
+    bool is_started = false;
+    bool is_detected = false;
+    while (reader.next(&record))
+    {
+        if (record.header.type == TraceType::Reset)
+        {
+            // The commander is aligned with the trace from its first reset.
+            commander->reset();
+            is_started = true;
+            continue;
+        }
+        if (record.header.type == TraceType::Sync)
+        {
+            // The state after a VAD restart aligns the commander even when the ring dropped the reset.
+            commander->reset();
+            if (!commander->restoreSync(record))
+            {
+                ESP_LOGE(TAG, "Sync record does not match the commander: %lu", record.header.sequence);
+                reader.close();
+                return false;
+            }
+            is_started = true;
+            continue;
+        }
+        if (!is_started)
+        {
+            if (record.header.type == TraceType::Frame) { report->skipped_num++; }
+            continue;
+        }
+
+        if (record.header.type == TraceType::Frame)
+        {
+            if (record.samples.size() != commander->feed_length())
+            {
+                ESP_LOGE(TAG, "Frame length mismatch: %d", static_cast<int>(record.samples.size()));
+                reader.close();
+                return false;
+            }
+
+            is_detected = commander->detect(record.samples.data(), &result);
+            const auto& stats = commander->frame_stats();
+            report->frame_num++;
+            report->vad_us += stats.vad_us;
+            report->mfcc_us += stats.mfcc_us;
+            report->fetch_us += stats.fetch_us;
+            report->score_us += stats.score_us;
+
+            const bool is_same = static_cast<uint8_t>(stats.vad_state) == record.frame.vad_state
+                && stats.frame_count == record.frame.frame_count
+                && stats.raw_length == record.frame.raw_length
+                && stats.can_fetch == static_cast<bool>(record.frame.can_fetch);
+            if (!is_same)
+            {
+                report->mismatch_num++;
+                if (report->first_mismatch < 0) { report->first_mismatch = record.header.sequence; }
+            }
+        }
+        else if (record.header.type == TraceType::Detect)
+        {
+            report->detect_num++;
+            const bool was_detected = record.detect.index >= 0;
+            if (was_detected != is_detected || (is_detected && result.score != record.detect.score))
+            {
+                report->detect_mismatch_num++;
+            }
+        }
+    }
+
+    reader.close();
+    if (!is_started)
+    {
+        ESP_LOGE(TAG, "No reset or sync record to align the replay with: %d frames in %s", report->skipped_num, path);
+        return false;
+    }
+    return true;
+}
+
+} // namespace cmdvox
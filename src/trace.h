@@ -0,0 +1,182 @@
+/*!
+ * CmdVox
+ *
+ * Copyright (c) 2023 MechaUma
+ *
+ * This software is released under the MIT.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef CMDVOX_TRACE_H_
+#define CMDVOX_TRACE_H_
+
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cmdvox.h"
+
+namespace cmdvox
+{
+
+enum class TraceType : uint8_t
+{
+    Reset,
+    Frame,
+    Segment,
+    Score,
+    Detect,
+    Sync,
+};
+
+struct TraceHeader
+{
+    uint32_t sequence;
+    uint16_t size;      // payload bytes
+    TraceType type;
+    uint8_t reserved;
+};
+
+struct TraceFrame
+{
+    uint32_t vad_us;
+    uint32_t mfcc_us;
+    uint16_t frame_count;
+    uint16_t raw_length;
+    uint16_t sample_num; // followed by int16_t samples[sample_num]
+    uint8_t vad_state;
+    uint8_t can_fetch;
+};
+
+struct TraceSegment
+{
+    uint16_t frame_num;
+    uint16_t reserved;
+    uint32_t fetch_us;
+};
+
+struct TraceScore
+{
+    uint32_t score;
+    int16_t index;
+    uint16_t reserved;
+};
+
+struct TraceDetect
+{
+    uint32_t score;
+    uint32_t score_us;
+    int16_t index;      // -1: not detected
+    uint16_t reserved;
+};
+
+/**
+ * @brief state of the commander at the end of a frame in which the VAD was restarted
+ * @note The VAD starts from scratch there, so a replay can be aligned with the rest of the stream
+ *       even after the ring has dropped the reset record.
+ */
+struct TraceSync
+{
+    uint16_t raw_length;            // queued samples at the MFCC rate
+    uint16_t frame_count;           // calculated frames
+    uint16_t coef_num;
+    uint16_t vad_history_length;    // samples of the decimator histories
+    uint16_t mfcc_history_length;
+    uint8_t has_energy;             // frame energies follow the frames
+    uint8_t reserved;
+    // followed by the queued samples, the VAD and MFCC decimator histories,
+    // frame_count x coef_num float coefficients and frame_count float energies
+};
+
+/**
+ * @brief bounded ring of trace records
+ * @note The oldest records are dropped when the ring is full.
+ *       Call it from the task that feeds the commander.
+ */
+class TraceWriter
+{
+public:
+    bool init(int capacity);
+    void deinit();
+    void clear();
+
+    void writeReset();
+    void writeFrame(const FrameStats& stats, const int16_t* samples, int sample_num);
+    void writeSegment(int frame_num, uint32_t fetch_us);
+    void writeScore(int index, uint32_t score);
+    void writeDetect(int index, uint32_t score, uint32_t score_us);
+    void writeSync(const TraceSync& sync, const int16_t* raw, const int16_t* vad_history, const int16_t* mfcc_history,
+        const float* frames, const float* energy);
+
+    /**
+     * @brief Writes all records as one chunk and clears the ring.
+     */
+    bool flush(FILE* file);
+
+private:
+    void write(TraceType type, const void* payload, int size, const int16_t* samples = nullptr, int sample_num = 0);
+    bool begin(TraceType type, int payload_size);
+    void push(const void* data, int size);
+    void peek(int offset, void* data, int size);
+
+    uint8_t* buffer_ = nullptr;
+    int capacity_ = 0;
+    int head_ = 0;
+    int length_ = 0;
+    uint32_t sequence_ = 0;
+};
+
+/**
+ * @brief one record read from a trace file
+ */
+struct TraceRecord
+{
+    TraceHeader header;
+    union
+    {
+        TraceFrame frame;
+        TraceSegment segment;
+        TraceScore score;
+        TraceDetect detect;
+        TraceSync sync;
+    };
+    std::vector<int16_t> samples;   // samples of a frame, or the state following a sync
+};
+
+class TraceReader
+{
+public:
+    bool open(const char* path);
+    void close();
+    bool next(TraceRecord* record);
+
+private:
+    FILE* file_ = nullptr;
+    uint32_t chunk_left_ = 0;
+};
+
+struct ReplayReport
+{
+    int skipped_num;        // frames before the first reset or sync record
+    int frame_num;
+    int mismatch_num;       // frames whose state differs from the trace
+    int first_mismatch;     // sequence of the first mismatch (-1: none)
+    int detect_num;
+    int detect_mismatch_num;
+    int64_t vad_us;
+    int64_t mfcc_us;
+    int64_t fetch_us;
+    int64_t score_us;
+};
+
+/**
+ * @brief Drives the commander with the recorded frames and compares the states.
+ * @note The commander must be initialized with the recorded config and commands.
+ *       Replay starts at the first reset or sync record in the trace and is realigned at every one after it.
+ * @return false if the trace has no record to align the commander with
+ */
+bool replayTrace(const char* path, MfccCommander* commander, ReplayReport* report);
+
+} // namespace cmdvox
+
+#endif // CMDVOX_TRACE_H_